@@ -0,0 +1,233 @@
+# Benchmark harness for the proxy: starts the proxy and a local origin
+# stub, drives the proxy with keep-alive clients and reports throughput,
+# latency percentiles and memory use. Results are appended to
+# bench_output.txt so runs can be compared over time.
+import socket
+import sys
+import os
+import argparse
+import asyncio
+import signal
+import subprocess
+import tempfile
+import time
+import random
+import shutil
+
+# Objects requested again and again, per object size, to make up the hits
+HOT_SET_SIZE = 64
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--proxy', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'Proxy-skeleton(2025).py'),
+                    help='the proxy script to benchmark')
+parser.add_argument('--workers', type=int, default=1,
+                    help='proxy worker processes')
+parser.add_argument('--concurrency', default='1,16,64',
+                    help='comma separated numbers of concurrent client connections to run with')
+parser.add_argument('--object-sizes', default='1024,65536,1048576',
+                    help='comma separated response body sizes in bytes to run with')
+parser.add_argument('--hit-ratios', default='0.9',
+                    help='comma separated shares of requests for already cached objects')
+parser.add_argument('--duration', type=float, default=10.0,
+                    help='seconds each combination is measured for')
+parser.add_argument('--origin-port', type=int, default=0,
+                    help='port of the origin stub, 0 for any free one')
+parser.add_argument('--output', default='bench_output.txt',
+                    help='file the results are appended to')
+parser.add_argument('--serve-origin', action='store_true',
+                    help=argparse.SUPPRESS)
+args = parser.parse_args()
+
+# ---- Origin stub ----
+
+# Answer GET /<size>/<name> with <size> bytes that may be cached for an
+# hour, over keep-alive connections
+async def serveOriginClient(reader, writer):
+  bodies = {}
+  try:
+    while True:
+      head = await reader.readuntil(b'\r\n\r\n')
+      path = head.split(b' ', 2)[1].decode('latin-1')
+      size = int(path.split('/')[1])
+      if size not in bodies:
+        bodies[size] = b'x' * size
+      writer.write(b'HTTP/1.1 200 OK\r\nContent-Length: ' + str(size).encode() +
+                   b'\r\nCache-Control: max-age=3600\r\nContent-Type: application/octet-stream\r\n\r\n')
+      writer.write(bodies[size])
+      await writer.drain()
+  except (asyncio.IncompleteReadError, ConnectionError, ValueError, IndexError):
+    pass
+  finally:
+    writer.close()
+
+async def runOrigin(port):
+  server = await asyncio.start_server(serveOriginClient, '127.0.0.1', port, backlog=1024)
+  async with server:
+    await server.serve_forever()
+
+# ---- Load generation ----
+
+# One client connection sending requests back to back until deadline.
+# Each request is for a hot object with probability hitRatio, otherwise
+# for one never asked for before. Latencies are appended in seconds.
+async def runClient(proxyPort, originPort, size, hitRatio, deadline, run, latencies, errors):
+  reader, writer = await asyncio.open_connection('127.0.0.1', proxyPort)
+  try:
+    while time.monotonic() < deadline:
+      if random.random() < hitRatio:
+        name = 'hot-' + str(random.randrange(HOT_SET_SIZE))
+      else:
+        name = 'cold-' + run + '-' + str(random.getrandbits(64))
+      host = '127.0.0.1:' + str(originPort)
+      request = 'GET http://' + host + '/' + str(size) + '/' + name + ' HTTP/1.1\r\nHost: ' + host + '\r\n\r\n'
+      started = time.monotonic()
+      writer.write(request.encode('latin-1'))
+      head = await reader.readuntil(b'\r\n\r\n')
+      await reader.readexactly(contentLength(head))
+      latencies.append(time.monotonic() - started)
+      if not head.startswith(b'HTTP/1.1 200') and not head.startswith(b'HTTP/1.0 200'):
+        errors.append(head.split(b'\r\n', 1)[0])
+  except (asyncio.IncompleteReadError, ConnectionError) as err:
+    errors.append(str(err))
+  finally:
+    writer.close()
+
+def contentLength(head):
+  for line in head.split(b'\r\n')[1:]:
+    field, sep, value = line.partition(b':')
+    if field.strip().lower() == b'content-length':
+      return int(value)
+  return 0
+
+# Request every hot object once so that later requests for them are hits
+async def warmUp(proxyPort, originPort, size):
+  reader, writer = await asyncio.open_connection('127.0.0.1', proxyPort)
+  host = '127.0.0.1:' + str(originPort)
+  try:
+    for i in range(HOT_SET_SIZE):
+      request = 'GET http://' + host + '/' + str(size) + '/hot-' + str(i) + ' HTTP/1.1\r\nHost: ' + host + '\r\n\r\n'
+      writer.write(request.encode('latin-1'))
+      head = await reader.readuntil(b'\r\n\r\n')
+      await reader.readexactly(contentLength(head))
+  finally:
+    writer.close()
+
+async def measure(proxyPort, originPort, concurrency, size, hitRatio, duration, run, proxyPid):
+  await warmUp(proxyPort, originPort, size)
+  latencies = []
+  errors = []
+  started = time.monotonic()
+  deadline = started + duration
+  clients = [asyncio.ensure_future(runClient(proxyPort, originPort, size, hitRatio, deadline, run, latencies, errors))
+             for i in range(concurrency)]
+  # Sample the proxy's memory while the clients run
+  peakRss = 0
+  while not all(client.done() for client in clients):
+    peakRss = max(peakRss, processTreeRss(proxyPid))
+    await asyncio.sleep(0.25)
+  await asyncio.gather(*clients, return_exceptions=True)
+  elapsed = time.monotonic() - started
+  return latencies, errors, elapsed, peakRss
+
+# ---- Reporting ----
+
+def percentile(ordered, fraction):
+  if not ordered:
+    return 0.0
+  return ordered[min(int(len(ordered) * fraction), len(ordered) - 1)]
+
+# Resident memory of a process and all its descendants, in bytes
+def processTreeRss(pid):
+  children = {}
+  for entry in os.listdir('/proc'):
+    if entry.isdigit():
+      try:
+        with open('/proc/' + entry + '/stat') as stat:
+          parent = int(stat.read().rsplit(')', 1)[1].split()[1])
+        children.setdefault(parent, []).append(int(entry))
+      except (OSError, IndexError, ValueError):
+        pass
+  total = 0
+  pending = [pid]
+  while pending:
+    current = pending.pop()
+    pending.extend(children.get(current, []))
+    try:
+      with open('/proc/' + str(current) + '/status') as status:
+        for line in status:
+          if line.startswith('VmRSS:'):
+            total += int(line.split()[1]) * 1024
+    except OSError:
+      pass
+  return total
+
+def freePort():
+  with socket.socket() as probe:
+    probe.bind(('127.0.0.1', 0))
+    return probe.getsockname()[1]
+
+def waitForPort(port, timeout):
+  deadline = time.monotonic() + timeout
+  while time.monotonic() < deadline:
+    try:
+      socket.create_connection(('127.0.0.1', port), 0.5).close()
+      return True
+    except OSError:
+      time.sleep(0.1)
+  return False
+
+def main():
+  concurrencies = [int(value) for value in args.concurrency.split(',')]
+  sizes = [int(value) for value in args.object_sizes.split(',')]
+  hitRatios = [float(value) for value in args.hit_ratios.split(',')]
+
+  workDir = tempfile.mkdtemp(prefix='proxy-bench-')
+  originPort = args.origin_port or freePort()
+  proxyPort = freePort()
+  origin = subprocess.Popen([sys.executable, os.path.abspath(__file__), '--serve-origin', '--origin-port', str(originPort)])
+  proxy = subprocess.Popen([sys.executable, args.proxy, '127.0.0.1', str(proxyPort), '--workers', str(args.workers),
+                            '--cache-dir', os.path.join(workDir, 'cache'), '--log-level', 'warning', '--no-access-log'],
+                           cwd=workDir)
+  try:
+    if not waitForPort(originPort, 10) or not waitForPort(proxyPort, 10):
+      print ('Proxy or origin stub did not start')
+      sys.exit(1)
+
+    lines = ['# ' + time.strftime('%Y-%m-%d %H:%M:%S') + ' ' + os.path.basename(args.proxy) +
+             ' workers=' + str(args.workers) + ' duration=' + str(args.duration) + 's',
+             '%-11s %-9s %-5s %10s %9s %9s %9s %8s %7s' %
+             ('concurrency', 'size', 'hits', 'req/s', 'p50 ms', 'p99 ms', 'p999 ms', 'RSS MiB', 'errors')]
+    print (lines[0])
+    print (lines[1])
+    run = 0
+    for size in sizes:
+      for hitRatio in hitRatios:
+        for concurrency in concurrencies:
+          run += 1
+          latencies, errors, elapsed, peakRss = asyncio.run(
+            measure(proxyPort, originPort, concurrency, size, hitRatio, args.duration, str(run), proxy.pid))
+          latencies.sort()
+          line = '%-11d %-9d %-5.2f %10.1f %9.3f %9.3f %9.3f %8.1f %7d' % (
+            concurrency, size, hitRatio, len(latencies) / elapsed,
+            percentile(latencies, 0.5) * 1000, percentile(latencies, 0.99) * 1000,
+            percentile(latencies, 0.999) * 1000, peakRss / (1024 * 1024), len(errors))
+          print (line)
+          lines.append(line)
+  finally:
+    proxy.send_signal(signal.SIGINT)
+    origin.terminate()
+    proxy.wait(10)
+    origin.wait(10)
+    shutil.rmtree(workDir, ignore_errors=True)
+
+  with open(args.output, 'a') as output:
+    output.write('\n'.join(lines) + '\n\n')
+  print ('Results appended to ' + args.output)
+
+if args.serve_origin:
+  try:
+    asyncio.run(runOrigin(args.origin_port))
+  except KeyboardInterrupt:
+    pass
+else:
+  main()
@@ -4,83 +4,2961 @@ import sys
 import os
 import argparse
 import re
+import asyncio
+import signal
+import errno
+import time
+import json
+import email.utils
+import contextvars
+import random
+import mmap
+import bisect
+import math
+import hashlib
+import queue
+import threading
+import zlib
+import html
+import urllib.parse
+import collections
+import subprocess
+from collections import OrderedDict
+try:
+  import brotli
+except ImportError:
+  brotli = None
 
-# 1MB buffer size
-BUFFER_SIZE = 1000000
+# Receive buffers come from a pool in these sizes
+BUFFER_SIZE_CLASSES = (4096, 16384, 65536, 262144)
+# Free buffers the pool keeps per size class
+BUFFER_POOL_FREE = 256
+# An over-budget disk cache is evicted down to this share of its budgets
+CACHE_LOW_WATER = 0.9
+# Cache shard directories are named by two hex digits of the key hash
+CACHE_SHARD_NAME = re.compile('[0-9a-f]{2}')
+# Cache index journals are numbered by generation
+CACHE_JOURNAL_NAME = re.compile(r'index\.(\d+)')
+# Log levels, least severe first
+LOG_LEVELS = ('debug', 'info', 'warning', 'error')
+# Most log records written in one batch, and queued before dropping them
+LOG_BATCH = 1024
+LOG_QUEUE_MAX = 65536
+# Log values written without quotes
+LOG_PLAIN_VALUE = re.compile(r'[^\s"=\\]+')
+# Resolution of the timer wheel driving every timeout, in seconds, and
+# its number of slots; later deadlines go round the wheel again
+TIMER_TICK = 0.1
+TIMER_SLOTS = 512
+# Cached bodies are sent in sendfile calls of this many bytes, each with
+# its own send timeout
+SENDFILE_SEGMENT = 262144
+# Content types worth compressing
+COMPRESSIBLE_TYPE = re.compile(r'\s*(text/|application/(json|(x-)?javascript|ecmascript|xml|[\w.-]+\+(json|xml))|image/svg\+xml)', re.I)
+# A Range header asking for one span of bytes, and a Content-Range value
+RANGE_SPEC = re.compile(r'\s*bytes\s*=\s*(\d*)\s*-\s*(\d*)\s*', re.I)
+CONTENT_RANGE = re.compile(r'\s*bytes\s+(?:(\d+)-(\d+)|\*)/(\d+|\*)\s*', re.I)
+# Pages scanned for resources to prefetch, the tags linking to those,
+# what is skipped looking for them and the <link> relations worth fetching
+PREFETCH_PAGE_TYPE = re.compile(r'\s*(text/html|application/xhtml\+xml)', re.I)
+PREFETCH_TAG = re.compile(r'<(link|script|img)\b([^>]*)>', re.I)
+HTML_OPAQUE = re.compile(r'(<script\b[^>]*>).*?</script\s*>|<!--.*?-->', re.I | re.S)
+PREFETCH_RELATIONS = ('stylesheet', 'icon', 'preload', 'modulepreload')
+HTML_ATTRIBUTE = re.compile(r'([\w-]+)\s*=\s*(?:"([^"]*)"|\'([^\']*)\'|([^\s"\'>]+))')
+# Bytes of a page scanned for links, and prefetches a worker keeps
+# queued at most
+PREFETCH_SCAN_BYTES = 1024 * 1024
+PREFETCH_QUEUE_MAX = 1024
+# Request headers a fetch the proxy makes on its own copies from the
+# request that led to it, for Vary
+BACKGROUND_HEADERS = (b'user-agent', b'accept', b'accept-language', b'accept-encoding')
+# Codings the proxy compresses to and decodes, most preferred first
+CONTENT_CODINGS = ('br', 'gzip') if brotli is not None else ('gzip',)
+# Headers that only concern one connection, never forwarded nor stored
+# (RFC 9110 section 7.6.1), and request headers the proxy writes itself
+HOP_BY_HOP_HEADERS = frozenset((b'connection', b'keep-alive', b'proxy-connection', b'proxy-authorization',
+                                b'te', b'trailer', b'transfer-encoding', b'upgrade'))
+PROXY_WRITTEN_HEADERS = frozenset((b'host', b'content-length', b'expect'))
+# Client headers left out when the proxy fetches a whole object to
+# store, and when it revalidates what it stored with its own validators
+PARTIAL_HEADERS = frozenset((b'range', b'if-range'))
+VALIDATOR_HEADERS = frozenset((b'if-none-match', b'if-modified-since'))
+# Most buffers handed to one sendmsg call
+IOV_MAX = os.sysconf('SC_IOV_MAX') if hasattr(os, 'sysconf') and 'SC_IOV_MAX' in os.sysconf_names else 1024
+# Clients and origins a rate limiter keeps a bucket for at most; the
+# least recently seen go first
+RATE_LIMIT_KEYS = 65536
+# Origin addresses whose health and load are tracked at most, and the
+# weight of each new latency sample in their moving average
+BALANCER_ADDRESSES = 65536
+BALANCER_DECAY = 0.3
+# Hostnames the DNS cache keeps answers for at most; the least recently
+# used go first
+DNS_CACHE_NAMES = 65536
+# Origin answers a stale response may stand in for under stale-if-error
+STALE_ERROR_STATUSES = (500, 502, 503, 504)
+# Seconds a worker waits before accepting again when it is short of file
+# descriptors or memory, and the accept errors that stop the worker
+# because its listening socket is unusable
+ACCEPT_RETRY_DELAY = 0.1
+ACCEPT_RESOURCE_ERRORS = (errno.EMFILE, errno.ENFILE, errno.ENOBUFS, errno.ENOMEM)
+ACCEPT_FATAL_ERRORS = (errno.EINVAL, errno.EBADF, errno.ENOTSOCK)
+# Methods a request may be retried with on another origin address
+IDEMPOTENT_METHODS = ('GET', 'HEAD', 'OPTIONS', 'TRACE', 'PUT', 'DELETE')
+# Environment variables that hand a proxy started by a graceful restart
+# the listening socket, the pipe it reports ready on and the pipe that
+# closes when the process it replaces exits
+INHERITED_SOCKET_ENV = 'PROXY_LISTEN_FD'
+READY_PIPE_ENV = 'PROXY_READY_FD'
+LIFELINE_PIPE_ENV = 'PROXY_LIFELINE_FD'
+# Path under which the proxy answers with its own metrics
+STATS_PATH = '/__stats'
+METRIC_COUNTERS = ('connections', 'requests', 'cache_hits', 'cache_misses', 'memory_hits',
+                   'memory_misses', 'revalidations', 'collapsed', 'bytes_from_origin',
+                   'bytes_from_cache', 'bad_requests', 'client_errors', 'origin_errors',
+                   'cache_evictions', 'cache_evicted_bytes', 'log_dropped', 'tunnels',
+                   'bytes_tunneled', 'timeouts', 'prefetches', 'rate_limited', 'origin_retries',
+                   'origin_ejections', 'stale_served')
+METRIC_GAUGES = ('open_connections', 'memory_cache_bytes')
+# Phases with a latency histogram, and its bucket bounds in seconds
+METRIC_PHASES = ('accept', 'parse', 'dns', 'connect', 'ttfb', 'transfer', 'cache_write')
+METRIC_BUCKETS = (0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+                  0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0)
 
 # Get the IP address and Port number to use for this web proxy server
 parser = argparse.ArgumentParser()
 parser.add_argument('hostname', help='the IP Address Of Proxy Server')
 parser.add_argument('port', help='the port number of the proxy server')
+parser.add_argument('--config',
+                    help='file of further options, read again on SIGHUP, which restarts the proxy gracefully')
+parser.add_argument('--workers', type=int, default=1,
+                    help='number of worker processes, 0 for one per CPU core')
+parser.add_argument('--relay-buffer', type=int, default=65536,
+                    help='bytes buffered per connection while relaying a response')
+parser.add_argument('--connection-buffer-cap', type=int, default=65536,
+                    help='largest buffer a client connection may grow to for its request head')
+parser.add_argument('--client-idle-timeout', type=float, default=15.0,
+                    help='seconds a kept-alive client connection may wait for its next request')
+parser.add_argument('--client-header-timeout', type=float, default=10.0,
+                    help='seconds a client has to send a whole request head once it starts')
+parser.add_argument('--client-body-timeout', type=float, default=30.0,
+                    help='seconds a request body may go without more of it arriving')
+parser.add_argument('--client-send-timeout', type=float, default=30.0,
+                    help='seconds a client may take to accept more of a response')
+parser.add_argument('--origin-connect-timeout', type=float, default=10.0,
+                    help='seconds to resolve and connect to an origin server')
+parser.add_argument('--origin-read-timeout', type=float, default=30.0,
+                    help='seconds an origin server may go without sending more of a response')
+parser.add_argument('--tunnel-idle-timeout', type=float, default=300.0,
+                    help='seconds a CONNECT tunnel may go without bytes in either direction')
+parser.add_argument('--drain-timeout', type=float, default=60.0,
+                    help='seconds connections have to finish once their worker stops after a restart or SIGQUIT')
+parser.add_argument('--client-rate', type=float, default=0.0,
+                    help='requests per second each client address may make per worker, 0 for no limit')
+parser.add_argument('--client-burst', type=float, default=0.0,
+                    help='requests a client may make at once above its rate, 0 for one second of it')
+parser.add_argument('--client-rate-delay', type=float, default=0.0,
+                    help='seconds a request over the client rate may be held back before it gets a 429')
+parser.add_argument('--client-connections', type=int, default=0,
+                    help='connections each client address may have open per worker, 0 for no limit')
+parser.add_argument('--origin-rate', type=float, default=0.0,
+                    help='requests per second each worker may send one origin server, 0 for no limit')
+parser.add_argument('--origin-burst', type=float, default=0.0,
+                    help='requests an origin may be sent at once above its rate, 0 for one second of it')
+parser.add_argument('--origin-connections', type=int, default=0,
+                    help='requests and tunnels each worker may have open to one origin server, 0 for no limit')
+parser.add_argument('--origin-queue-timeout', type=float, default=5.0,
+                    help='seconds a request may wait for an origin limit before it gets a 503')
+parser.add_argument('--memory-cache-size', type=int, default=64 * 1024 * 1024,
+                    help='bytes of hot objects kept in memory per worker, 0 to disable')
+parser.add_argument('--memory-object-max', type=int, default=1024 * 1024,
+                    help='largest object admitted to the in-memory cache')
+parser.add_argument('--cache-dir', default='cache',
+                    help='directory holding the cache index and body files')
+parser.add_argument('--cache-max-bytes', type=int, default=1024 * 1024 * 1024,
+                    help='bytes of response bodies the disk cache may hold')
+parser.add_argument('--cache-max-objects', type=int, default=100000,
+                    help='responses the disk cache may hold')
+parser.add_argument('--cache-eviction', choices=('lru', 'lfu', 'gdsf'), default='lru',
+                    help='which responses go first when the disk cache is over budget')
+parser.add_argument('--cache-sweep-interval', type=float, default=5.0,
+                    help='seconds between checks of the disk cache budgets')
+parser.add_argument('--cache-checkpoint-interval', type=float, default=300.0,
+                    help='seconds between checkpoints of the cache index')
+parser.add_argument('--cache-fsync', choices=('none', 'data', 'full'), default='data',
+                    help='what is fsynced before a cache file is renamed into place')
+parser.add_argument('--cache-write-backlog', type=int, default=8 * 1024 * 1024,
+                    help='bytes a response may get ahead of the cache writer thread')
+parser.add_argument('--no-compression', dest='compression', action='store_false',
+                    help='relay and cache responses in the coding the origin sent')
+parser.add_argument('--compress-level', type=int, default=6,
+                    help='gzip level and brotli quality of responses the proxy compresses')
+parser.add_argument('--compress-min-size', type=int, default=1024,
+                    help='smallest response body worth compressing')
+parser.add_argument('--compress-max-size', type=int, default=8 * 1024 * 1024,
+                    help='largest cached body turned into another coding in one piece')
+parser.add_argument('--stale-while-revalidate', type=float, default=0.0,
+                    help='seconds past expiry a response without its own window is served while it is revalidated')
+parser.add_argument('--stale-if-error', type=float, default=0.0,
+                    help='seconds past expiry a response without its own window is served when the origin fails')
+parser.add_argument('--slice-size', type=int, default=1024 * 1024,
+                    help='bytes per slice a large object is cached in for range requests, 0 to disable')
+parser.add_argument('--prefetch', action='store_true',
+                    help='fetch the stylesheets, scripts and images of cached HTML pages ahead of the browser')
+parser.add_argument('--prefetch-concurrency', type=int, default=4,
+                    help='prefetches each worker runs at once')
+parser.add_argument('--prefetch-links', type=int, default=32,
+                    help='most resources prefetched for one page')
+parser.add_argument('--origin-pool-size', type=int, default=8,
+                    help='idle keep-alive connections kept per origin server')
+parser.add_argument('--origin-idle-timeout', type=float, default=30.0,
+                    help='seconds an idle origin connection is kept before closing it')
+parser.add_argument('--origin-max-fails', type=int, default=3,
+                    help='failures in a row that take an origin address out of rotation')
+parser.add_argument('--origin-eject-time', type=float, default=10.0,
+                    help='seconds a failing origin address stays out of rotation')
+parser.add_argument('--origin-retries', type=int, default=1,
+                    help='other addresses an idempotent request is retried on when one fails')
+parser.add_argument('--dns-ttl', type=float, default=60.0,
+                    help='seconds a resolved origin address is cached')
+parser.add_argument('--dns-negative-ttl', type=float, default=5.0,
+                    help='seconds a failed origin lookup is cached')
+parser.add_argument('--happy-eyeballs-delay', type=float, default=0.25,
+                    help='seconds before racing the next origin address')
+parser.add_argument('--listen-backlog', type=int, default=1024,
+                    help='connections the kernel queues for accepting, capped by net.core.somaxconn')
+parser.add_argument('--reuse-port', action='store_true',
+                    help='give every worker its own listening socket with SO_REUSEPORT')
+parser.add_argument('--no-tcp-nodelay', dest='tcp_nodelay', action='store_false',
+                    help='leave Nagle\'s algorithm on for client and origin connections')
+parser.add_argument('--tcp-fastopen', type=int, default=0,
+                    help='length of the TCP Fast Open queue for clients, 0 to disable')
+parser.add_argument('--origin-fastopen', action='store_true',
+                    help='use TCP Fast Open when connecting to origin servers')
+parser.add_argument('--socket-send-buffer', type=int, default=0,
+                    help='SO_SNDBUF for client and origin connections, 0 for the system default')
+parser.add_argument('--socket-receive-buffer', type=int, default=0,
+                    help='SO_RCVBUF for client and origin connections, 0 for the system default')
+parser.add_argument('--connect-ports', default='443',
+                    help='comma separated ports CONNECT may open tunnels to')
+parser.add_argument('--log-level', choices=LOG_LEVELS, default='info',
+                    help='least severe log records written')
+parser.add_argument('--log-file', default='-',
+                    help='file log records are appended to, - for standard output')
+parser.add_argument('--log-debug-sample', type=float, default=0.01,
+                    help='share of requests that write debug records at the debug level')
+parser.add_argument('--no-access-log', dest='access_log', action='store_false',
+                    help='do not write a log line for every request')
+
+# Options from a config file as command line arguments. Each line holds
+# one long option without its dashes, as name = value, or just the name
+# of a flag; # starts a comment.
+def configArguments(location):
+  arguments = []
+  with open(location) as config:
+    for line in config:
+      line = line.split('#', 1)[0].strip()
+      if line:
+        name, sep, value = line.partition('=')
+        arguments.append('--' + name.strip())
+        if sep:
+          arguments.append(value.strip())
+  return arguments
+
+# The config file sets the defaults, so options given on the command
+# line take precedence over it
 args = parser.parse_args()
+if args.config is not None:
+  try:
+    configured = configArguments(args.config)
+  except OSError as err:
+    parser.error('cannot read config file: ' + str(err))
+  parser.set_defaults(**vars(parser.parse_args([args.hostname, args.port] + configured)))
+  args = parser.parse_args()
 proxyHost = args.hostname
 proxyPort = int(args.port)
+workerCount = args.workers if args.workers > 0 else (os.cpu_count() or 1)
+RELAY_BUFFER_SIZE = max(args.relay_buffer, 1024)
+CONNECTION_BUFFER_CAP = max(args.connection_buffer_cap, BUFFER_SIZE_CLASSES[0])
+CLIENT_IDLE_TIMEOUT = args.client_idle_timeout
+CLIENT_HEADER_TIMEOUT = args.client_header_timeout
+CLIENT_BODY_TIMEOUT = args.client_body_timeout
+CLIENT_SEND_TIMEOUT = args.client_send_timeout
+ORIGIN_CONNECT_TIMEOUT = args.origin_connect_timeout
+ORIGIN_READ_TIMEOUT = args.origin_read_timeout
+TUNNEL_IDLE_TIMEOUT = args.tunnel_idle_timeout
+DRAIN_TIMEOUT = max(args.drain_timeout, 0)
+CLIENT_RATE_DELAY = max(args.client_rate_delay, 0)
+ORIGIN_QUEUE_TIMEOUT = max(args.origin_queue_timeout, 0)
+COMPRESSION = args.compression
+COMPRESS_LEVEL = min(max(args.compress_level, 1), 9)
+COMPRESS_MIN_SIZE = args.compress_min_size
+COMPRESS_MAX_SIZE = args.compress_max_size
+SLICE_SIZE = max(args.slice_size, 0)
+STALE_WHILE_REVALIDATE = max(args.stale_while_revalidate, 0)
+STALE_IF_ERROR = max(args.stale_if_error, 0)
+HAPPY_EYEBALLS_DELAY = args.happy_eyeballs_delay
+ORIGIN_RETRIES = max(args.origin_retries, 0)
+CACHE_SWEEP_INTERVAL = args.cache_sweep_interval
+CACHE_CHECKPOINT_INTERVAL = args.cache_checkpoint_interval
+LISTEN_BACKLOG = max(args.listen_backlog, 1)
+# Not every Python names this Linux option
+TCP_FASTOPEN_CONNECT = getattr(socket, 'TCP_FASTOPEN_CONNECT', 30 if sys.platform.startswith('linux') else None)
+CONNECT_PORTS = set(int(port) for port in args.connect_ports.split(',') if port)
 
-# Create a server socket, bind it to a port and start listening
-try:
-  # Create a server socket
-  # ~~~~ INSERT CODE ~~~~
-  serverSocket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-  # ~~~~ END CODE INSERT ~~~~
-  print ('Created socket')
-except:
-  print ('Failed to create socket')
-  sys.exit()
+# Leveled logging kept off the serving path. A record is queued as its
+# raw fields, and a background thread formats records as key=value lines
+# and writes them out in batches, one write per batch. Until start() is
+# called in a worker, records are written straight away. Debug records
+# are sampled per request, so a sampled request logs all of its own.
+class Log:
+  def __init__(self, level, fd, debugSample, accessLog):
+    self.level = LOG_LEVELS.index(level)
+    self.fd = fd
+    self.debugSample = debugSample
+    self.accessLog = accessLog
+    self.queue = None
+    self.thread = None
+    # Held by the writer thread while it writes, so a fork can wait for it
+    self.busy = threading.Lock()
+    self.sampled = contextvars.ContextVar('sampled', default=True)
 
-try:
-  # Bind the the server socket to a host and port
-  # ~~~~ INSERT CODE ~~~~
-  serverSocket.bind((proxyHost, proxyPort))
-  # ~~~~ END CODE INSERT ~~~~
-  print ('Port is bound')
-except:
-  print('Port is already in use')
-  sys.exit()
+  # Start the writer thread of this process
+  def start(self):
+    self.queue = queue.SimpleQueue()
+    self.thread = threading.Thread(target=self.run, name='log-writer', daemon=True)
+    self.thread.start()
 
-try:
-  # Listen on the server socket
-  # ~~~~ INSERT CODE ~~~~
-  serverSocket.listen(5)
-  # ~~~~ END CODE INSERT ~~~~
-  print ('Listening to socket')
-except:
-  print ('Failed to listen')
-  sys.exit()
+  # Write out what is queued and end the writer thread, before exiting
+  def stop(self):
+    if self.thread is not None:
+      self.queue.put(None)
+      self.thread.join()
+      self.queue = None
+      self.thread = None
 
-# continuously accept connections
-while True:
-  print ('Waiting for connection...')
-  clientSocket = None
+  # In a process forked from this one the writer thread is gone, so
+  # records are written out straight away
+  def forked(self):
+    self.queue = None
+    self.thread = None
+
+  def run(self):
+    while True:
+      records = [self.queue.get()]
+      while len(records) < LOG_BATCH and records[-1] is not None:
+        try:
+          records.append(self.queue.get_nowait())
+        except queue.Empty:
+          break
+      with self.busy:
+        self.write(''.join(self.format(*record) for record in records if record is not None))
+      if records[-1] is None:
+        return
+
+  def write(self, text):
+    data = text.encode('latin-1', 'replace')
+    try:
+      while data:
+        data = data[os.write(self.fd, data):]
+    except OSError:
+      pass
+
+  # Decide whether the request the current task is serving logs debug
+  def sample(self):
+    self.sampled.set(self.level == 0 and random.random() < self.debugSample)
+
+  def debug(self, message, **fields):
+    if self.level == 0 and self.sampled.get():
+      self.emit('debug', message, fields)
+
+  def info(self, message, **fields):
+    if self.level <= 1:
+      self.emit('info', message, fields)
+
+  def warning(self, message, **fields):
+    if self.level <= 2:
+      self.emit('warning', message, fields)
+
+  def error(self, message, **fields):
+    self.emit('error', message, fields)
+
+  # One line for a finished request
+  def access(self, **fields):
+    if self.accessLog:
+      self.emit('info', 'access', fields)
+
+  def emit(self, level, message, fields):
+    record = (time.time(), level, message, fields)
+    if self.queue is None:
+      self.write(self.format(*record))
+    elif self.queue.qsize() < LOG_QUEUE_MAX:
+      self.queue.put(record)
+    else:
+      metrics.count('log_dropped')
+
+  @staticmethod
+  def format(timestamp, level, message, fields):
+    line = ('ts=' + time.strftime('%Y-%m-%dT%H:%M:%S', time.gmtime(timestamp)) +
+            '.%03dZ' % (timestamp % 1 * 1000) + ' level=' + level + ' msg=' + Log.quote(message))
+    for name, value in fields.items():
+      if isinstance(value, float):
+        value = '%.3f' % value
+      line += ' ' + name + '=' + Log.quote('-' if value is None else str(value))
+    return line + '\n'
+
+  @staticmethod
+  def quote(value):
+    if value and LOG_PLAIN_VALUE.fullmatch(value):
+      return value
+    return json.dumps(value)
 
-  # Accept connection from client and store in the clientSocket
+log = Log(args.log_level, sys.stdout.fileno() if args.log_file == '-' else
+          os.open(args.log_file, os.O_WRONLY | os.O_CREAT | os.O_APPEND, 0o644),
+          args.log_debug_sample, args.access_log)
+
+# Set the buffer sizes asked for on sock. A listening socket passes them
+# on to the connections it accepts, before their window scale is agreed.
+def tuneSocketBuffers(sock):
+  if args.socket_send_buffer > 0:
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, args.socket_send_buffer)
+  if args.socket_receive_buffer > 0:
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, args.socket_receive_buffer)
+
+# Responses are written in as few sends as possible already, so waiting
+# to coalesce them only adds a round trip of delay
+def tuneConnection(sock):
+  if args.tcp_nodelay:
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+# Create a server socket, bind it to a port and start listening. With
+# SO_REUSEPORT several sockets can be bound to the same port and the
+# kernel spreads new connections across the ones listening. The address
+# stays usable right after a restart while old connections sit in
+# TIME_WAIT.
+def openServerSocket(listen=True):
+  try:
+    # Create a server socket
+    # ~~~~ INSERT CODE ~~~~
+    serverSocket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    serverSocket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    if args.reuse_port:
+      serverSocket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+    tuneSocketBuffers(serverSocket)
+    # The event loop multiplexes every client and origin socket, so none of them may block
+    serverSocket.setblocking(False)
+    # ~~~~ END CODE INSERT ~~~~
+    log.info('Created socket')
+  except:
+    log.error('Failed to create socket')
+    sys.exit()
+
+  try:
+    # Bind the the server socket to a host and port
+    # ~~~~ INSERT CODE ~~~~
+    serverSocket.bind((proxyHost, proxyPort))
+    # ~~~~ END CODE INSERT ~~~~
+    log.info('Port is bound')
+  except:
+    log.error('Port is already in use')
+    sys.exit()
+
+  if not listen:
+    return serverSocket
   try:
+    # Listen on the server socket
     # ~~~~ INSERT CODE ~~~~
-    clientSocket, clientAddress = serverSocket.accept()
+    startListening(serverSocket)
     # ~~~~ END CODE INSERT ~~~~
-    print ('Received a connection')
+    log.info('Listening to socket')
   except:
-    print ('Failed to accept connection')
+    log.error('Failed to listen')
     sys.exit()
+  return serverSocket
+
+def startListening(serverSocket):
+  if args.tcp_fastopen > 0:
+    serverSocket.setsockopt(socket.IPPROTO_TCP, socket.TCP_FASTOPEN, args.tcp_fastopen)
+  serverSocket.listen(LISTEN_BACKLOG)
+
+# With a socket per worker the one made here only checks that the port
+# can be bound; it never listens, or the kernel would queue connections
+# on it that no worker accepts. After a graceful restart the socket is
+# the one the old process had, so no connection waiting on it is lost.
+# The new config decides again whether it listens; one that would leave
+# it listening with nobody accepting is refused, and the old process
+# carries on.
+acceptsOnServerSocket = not args.reuse_port or workerCount == 1
+inheritedSocket = os.environ.pop(INHERITED_SOCKET_ENV, None)
+if inheritedSocket is not None:
+  serverSocket = socket.socket(fileno=int(inheritedSocket))
+  serverSocket.setblocking(False)
+  if acceptsOnServerSocket:
+    try:
+      startListening(serverSocket)
+    except OSError as err:
+      log.error('Failed to listen', error=err)
+      sys.exit()
+  elif serverSocket.getsockopt(socket.SOL_SOCKET, socket.SO_ACCEPTCONN):
+    log.error('Cannot take over a listening socket with a socket per worker')
+    sys.exit()
+  log.info('Took over listening socket')
+else:
+  serverSocket = openServerSocket(acceptsOnServerSocket)
+
+# Counters and latency histograms. Every worker updates its own slot of
+# an anonymous mapping shared by all of them, made before they fork, so a
+# count is a single store with no locking and no message passing;
+# /__stats adds up the slots of all workers. Gauges live in the slots too
+# and are moved with count() like the counters.
+class Metrics:
+  def __init__(self, workers):
+    self.counterOffsets = {}
+    for name in METRIC_COUNTERS + METRIC_GAUGES:
+      self.counterOffsets[name] = len(self.counterOffsets)
+    # Each histogram holds its buckets, the overflow bucket and the sum
+    self.histogramSize = len(METRIC_BUCKETS) + 2
+    self.phaseOffsets = {}
+    for i, phase in enumerate(METRIC_PHASES):
+      self.phaseOffsets[phase] = len(self.counterOffsets) + i * self.histogramSize
+    self.slotSize = len(self.counterOffsets) + len(METRIC_PHASES) * self.histogramSize
+    self.shared = mmap.mmap(-1, 8 * self.slotSize * workers)
+    self.values = memoryview(self.shared).cast('d')
+    self.slot = 0
+
+  # Write to the slot of worker index from now on
+  def select(self, index):
+    self.slot = index * self.slotSize
+
+  def count(self, name, amount=1):
+    self.values[self.slot + self.counterOffsets[name]] += amount
+
+  def observe(self, phase, seconds):
+    offset = self.slot + self.phaseOffsets[phase]
+    self.values[offset + bisect.bisect_left(METRIC_BUCKETS, seconds)] += 1
+    self.values[offset + self.histogramSize - 1] += seconds
+
+  def total(self, offset):
+    return sum(self.values[slot + offset] for slot in range(0, len(self.values), self.slotSize))
+
+  # All metrics in the Prometheus text format
+  def render(self):
+    lines = []
+    for name in METRIC_COUNTERS:
+      lines.append('# TYPE proxy_' + name + '_total counter')
+      lines.append('proxy_' + name + '_total ' + str(int(self.total(self.counterOffsets[name]))))
+    for name in METRIC_GAUGES:
+      lines.append('# TYPE proxy_' + name + ' gauge')
+      lines.append('proxy_' + name + ' ' + str(int(self.total(self.counterOffsets[name]))))
+    for phase in METRIC_PHASES:
+      name = 'proxy_' + phase + '_seconds'
+      offset = self.phaseOffsets[phase]
+      lines.append('# TYPE ' + name + ' histogram')
+      observed = 0
+      for i, bound in enumerate(METRIC_BUCKETS + ('+Inf',)):
+        observed += int(self.total(offset + i))
+        lines.append(name + '_bucket{le="' + str(bound) + '"} ' + str(observed))
+      lines.append(name + '_sum ' + repr(self.total(offset + self.histogramSize - 1)))
+      lines.append(name + '_count ' + str(observed))
+    return '\n'.join(lines) + '\n'
+
+metrics = Metrics(workerCount)
+
+# Receive buffers shared by all connections of a worker. A request for a
+# buffer is rounded up to one of BUFFER_SIZE_CLASSES and served from that
+# class's free list, so the steady state allocates nothing per recv.
+# Requests above the largest class are allocated exactly and not kept.
+class BufferPool:
+  def __init__(self, sizeClasses, maxFree):
+    self.sizeClasses = sizeClasses
+    self.maxFree = maxFree
+    self.free = {size: [] for size in sizeClasses}
 
-  # Get HTTP request from client
-  # and store it in the variable: message_bytes
+  def acquire(self, size):
+    for sizeClass in self.sizeClasses:
+      if size <= sizeClass:
+        freeList = self.free[sizeClass]
+        return freeList.pop() if freeList else bytearray(sizeClass)
+    return bytearray(size)
+
+  def release(self, buffer):
+    freeList = self.free.get(len(buffer))
+    if freeList is not None and len(freeList) < self.maxFree:
+      freeList.append(buffer)
+
+bufferPool = BufferPool(BUFFER_SIZE_CLASSES, BUFFER_POOL_FREE)
+
+# Size-bounded LRU of whole responses for the hottest URLs, keyed by
+# hostname + resource. It sits in front of the disk cache, which stays the
+# authoritative copy; an entry only ever holds bytes also written to disk.
+# Each value is stored with the number of bytes it accounts for.
+class MemoryCache:
+  def __init__(self, maxBytes, maxObjectBytes):
+    self.maxBytes = maxBytes
+    self.maxObjectBytes = min(maxObjectBytes, maxBytes)
+    self.entries = OrderedDict()
+    self.usedBytes = 0
+
+  def get(self, key):
+    stored = self.entries.get(key)
+    if stored is None:
+      metrics.count('memory_misses')
+      return None
+    self.entries.move_to_end(key)
+    metrics.count('memory_hits')
+    return stored[0]
+
+  def put(self, key, value, size):
+    if size > self.maxObjectBytes:
+      return
+    self.remove(key)
+    self.entries[key] = (value, size)
+    self.usedBytes += size
+    metrics.count('memory_cache_bytes', size)
+    # Evict least recently used objects until we are back under budget
+    while self.usedBytes > self.maxBytes:
+      oldKey, (oldValue, oldSize) = self.entries.popitem(last=False)
+      self.usedBytes -= oldSize
+      metrics.count('memory_cache_bytes', -oldSize)
+
+  def remove(self, key):
+    stored = self.entries.pop(key, None)
+    if stored is not None:
+      self.usedBytes -= stored[1]
+      metrics.count('memory_cache_bytes', -stored[1])
+
+memoryCache = MemoryCache(args.memory_cache_size, args.memory_object_max)
+
+# Finds the end of a chunked body as its raw bytes stream past, without
+# changing them, so chunked messages can be forwarded as they are. Where
+# the chunk data lies in them can be collected as well, for a de-chunked
+# copy.
+class ChunkedFramer:
+  def __init__(self):
+    self.state = 'size'
+    self.remaining = 0
+    self.lineBuffer = b''
+    self.done = False
+
+  # Scan data[pos:end] and return the position just past the body, or end
+  # when the body continues beyond it. The (start, stop) ranges of chunk
+  # data found are appended to spans when given.
+  def feed(self, data, pos, end, spans=None):
+    while pos < end:
+      if self.state == 'data':
+        # Chunk bytes plus the CRLF that closes the chunk
+        take = min(self.remaining, end - pos)
+        if spans is not None and self.remaining > 2:
+          spans.append((pos, pos + min(take, self.remaining - 2)))
+        pos += take
+        self.remaining -= take
+        if self.remaining == 0:
+          self.state = 'size'
+        continue
+
+      lineEnd = data.find(b'\n', pos, end)
+      if lineEnd < 0:
+        self.lineBuffer += data[pos:end]
+        return end
+      line = self.lineBuffer + data[pos:lineEnd]
+      self.lineBuffer = b''
+      pos = lineEnd + 1
+      if self.state == 'size':
+        size = int(line.split(b';', 1)[0].strip(), 16)
+        if size == 0:
+          self.state = 'trailer'
+        else:
+          self.state = 'data'
+          self.remaining = size + 2
+      elif line.strip() == b'':
+        # Empty line after the last chunk and any trailers
+        self.done = True
+        return pos
+    return pos
+
+# Follows an origin response as it streams past and works out where it
+# ends: after Content-Length body bytes, after the last chunk of a chunked
+# body, or when the origin closes. Only the first two leave the connection
+# usable for another request.
+class ResponseFramer:
+  def __init__(self, method):
+    self.method = method
+    self.headBuffer = bytearray()
+    self.head = None
+    self.bodyStart = 0
+    self.headers = None
+    self.status = None
+    self.remaining = None
+    self.chunks = None
+    self.payload = []
+    self.done = False
+    self.reusable = True
+
+  # Consume data[:end] and return how many of its bytes belong to this
+  # response. For a chunked body, payload is then left holding the ranges
+  # of data[:end] that are chunk data.
+  def feed(self, data, end=None):
+    if end is None:
+      end = len(data)
+    pos = 0
+    self.payload = []
+    if self.headers is None:
+      start = max(len(self.headBuffer) - 3, 0)
+      with memoryview(data) as view:
+        self.headBuffer += view[:end]
+      while True:
+        headEnd = self.headBuffer.find(b'\r\n\r\n', start)
+        if headEnd < 0:
+          return end
+        pos = end - (len(self.headBuffer) - headEnd - 4)
+        self.head = bytes(self.headBuffer[:headEnd + 4])
+        self.parseHead(self.head[:headEnd])
+        if self.headers is not None:
+          break
+        # An interim response was dropped; the final head follows it
+        del self.headBuffer[:headEnd + 4]
+        start = 0
+      self.bodyStart = pos
+      self.headBuffer = None
+      if self.done:
+        return pos
+    if self.chunks is not None:
+      pos = self.chunks.feed(data, pos, end, self.payload)
+      self.done = self.chunks.done
+      return pos
+    if self.remaining is not None:
+      take = min(self.remaining, end - pos)
+      self.remaining -= take
+      if self.remaining == 0:
+        self.done = True
+      return pos + take
+    # Close-delimited body: everything the origin sends is part of it
+    return end
+
+  # Parse a response head, raising ValueError when it is malformed. An
+  # interim 1xx head leaves headers unset: the final response is still to
+  # come. The proxy never forwards Upgrade, so a 101 is the origin's error.
+  def parseHead(self, head):
+    lines = head.decode('latin-1').split('\r\n')
+    statusParts = lines[0].split(None, 2)
+    if len(statusParts) < 2 or not statusParts[0].startswith('HTTP/') or not re.fullmatch(r'[0-9]{3}', statusParts[1]):
+      raise ValueError('malformed status line')
+    responseVersion = statusParts[0]
+    self.status = int(statusParts[1])
+    if self.status == 101:
+      raise ValueError('origin switched protocols unasked')
+    if self.status < 200:
+      return
+    self.headers = {}
+    for line in lines[1:]:
+      name, sep, value = line.partition(':')
+      if sep:
+        name = name.strip().lower()
+        value = value.strip()
+        if name in self.headers:
+          value = self.headers[name] + ', ' + value
+        self.headers[name] = value
+
+    connection = self.headers.get('connection', '').lower()
+    if 'close' in connection or (responseVersion == 'HTTP/1.0' and 'keep-alive' not in connection):
+      self.reusable = False
+
+    # These responses never carry a body whatever their headers say
+    if self.method == 'HEAD' or self.status in (204, 304):
+      self.done = True
+    elif 'chunked' in self.headers.get('transfer-encoding', '').lower():
+      self.chunks = ChunkedFramer()
+    elif 'content-length' in self.headers:
+      contentLength = self.headers['content-length']
+      if not re.fullmatch(r'[0-9]+', contentLength):
+        raise ValueError('malformed content-length')
+      self.remaining = int(contentLength)
+      self.done = self.remaining == 0
+    else:
+      self.reusable = False
+
+  # The origin closed the connection; that only ends a close-delimited body
+  def finish(self):
+    self.reusable = False
+    if self.headers is None or self.chunks is not None or self.remaining is not None:
+      if not self.done:
+        raise ConnectionError('origin closed the connection mid-response')
+    self.done = True
+
+# Idle keep-alive connections to origin servers, kept per hostname so a
+# cache miss can skip the DNS lookup and TCP handshake. At most maxIdle
+# connections are kept per origin and none longer than idleTimeout seconds.
+class OriginPool:
+  def __init__(self, maxIdle, idleTimeout):
+    self.maxIdle = maxIdle
+    self.idleTimeout = idleTimeout
+    self.idle = {}
+
+  def acquire(self, hostname):
+    connections = self.idle.get(hostname)
+    while connections:
+      originServerSocket, idleSince = connections.pop()
+      if time.monotonic() - idleSince < self.idleTimeout and self.isAlive(originServerSocket):
+        return originServerSocket
+      originServerSocket.close()
+    return None
+
+  def release(self, hostname, originServerSocket):
+    connections = self.idle.setdefault(hostname, [])
+    if len(connections) >= self.maxIdle:
+      originServerSocket.close()
+      return
+    connections.append((originServerSocket, time.monotonic()))
+
+  # An idle connection that is readable has either been closed by the
+  # origin or holds bytes nobody asked for; neither can be reused
+  def isAlive(self, originServerSocket):
+    try:
+      return not originServerSocket.recv(1, socket.MSG_PEEK)
+    except BlockingIOError:
+      return True
+    except OSError:
+      return False
+
+  # Close connections that have been idle too long
+  def closeExpired(self):
+    now = time.monotonic()
+    for hostname in list(self.idle):
+      connections = self.idle[hostname]
+      while connections and now - connections[0][1] >= self.idleTimeout:
+        connections.pop(0)[0].close()
+      if not connections:
+        del self.idle[hostname]
+
+originPool = OriginPool(args.origin_pool_size, args.origin_idle_timeout)
+
+# Caches resolved origin addresses per hostname. getaddrinfo runs on the
+# default executor so a slow resolver never blocks the event loop, and
+# concurrent misses for one hostname share a single lookup. The system
+# resolver does not report record TTLs, so answers are kept for ttl
+# seconds and failures for negativeTtl seconds.
+class DNSCache:
+  def __init__(self, ttl, negativeTtl):
+    self.ttl = ttl
+    self.negativeTtl = negativeTtl
+    self.entries = OrderedDict()
+    self.pending = {}
+
+  # Return the (family, sockaddr) pairs for hostname, ordered as RFC 8305
+  # asks: alternating address families, starting with the preferred one
+  async def resolve(self, hostname, port):
+    key = (hostname, port)
+    entry = self.entries.get(key)
+    if entry is not None:
+      if entry[0] > time.monotonic():
+        self.entries.move_to_end(key)
+        if isinstance(entry[1], tuple):
+          # A fresh exception each time: raising a stored one would keep
+          # the frames of every request it failed alive in its traceback
+          errorType, errorArgs = entry[1]
+          raise errorType(*errorArgs)
+        return entry[1]
+      del self.entries[key]
+
+    lookup = self.pending.get(key)
+    if lookup is None:
+      lookup = asyncio.ensure_future(self.lookup(hostname, port))
+      self.pending[key] = lookup
+      lookup.add_done_callback(lambda done: self.pending.pop(key, None))
+    return await asyncio.shield(lookup)
+
+  async def lookup(self, hostname, port):
+    loop = asyncio.get_running_loop()
+    key = (hostname, port)
+    try:
+      results = await loop.getaddrinfo(hostname, port, type=socket.SOCK_STREAM)
+    except OSError as err:
+      self.store(key, self.negativeTtl, (err.__class__, err.args))
+      raise
+
+    byFamily = {}
+    for family, type, proto, canonname, sockaddr in results:
+      if sockaddr not in byFamily.setdefault(family, []):
+        byFamily[family].append(sockaddr)
+    families = [results[0][0]] + [family for family in byFamily if family != results[0][0]]
+    addresses = []
+    while any(byFamily.values()):
+      for family in families:
+        if byFamily[family]:
+          addresses.append((family, byFamily[family].pop(0)))
+
+    self.store(key, self.ttl, addresses)
+    return addresses
+
+  # Keep an answer, the addresses or the (type, args) of the lookup's
+  # error, for ttl seconds. Expired answers at the least recently used
+  # end go first, then any over DNS_CACHE_NAMES.
+  def store(self, key, ttl, answer):
+    now = time.monotonic()
+    while self.entries and next(iter(self.entries.values()))[0] <= now:
+      self.entries.popitem(last=False)
+    self.entries[key] = (now + ttl, answer)
+    self.entries.move_to_end(key)
+    if len(self.entries) > DNS_CACHE_NAMES:
+      self.entries.popitem(last=False)
+
+dnsCache = DNSCache(args.dns_ttl, args.dns_negative_ttl)
+
+class AddressStats:
+  __slots__ = ('latency', 'outstanding', 'fails', 'ejectedUntil')
+
+  def __init__(self):
+    self.latency = 0.0
+    self.outstanding = 0
+    self.fails = 0
+    self.ejectedUntil = 0.0
+
+# Passive health and load of every origin address, for spreading new
+# connections over the addresses of a hostname. Each address keeps a
+# moving average of its connect and first-byte latency and a count of
+# connects and requests outstanding on it, and is preferred by the lowest
+# (outstanding + 1) * latency, so a slow or busy address gets less. After
+# maxFails failures in a row an address is ejected for ejectTime seconds,
+# during which it is only tried after all the others; its next failure
+# ejects it again.
+class OriginBalancer:
+  def __init__(self, maxFails, ejectTime):
+    self.maxFails = max(maxFails, 1)
+    self.ejectTime = ejectTime
+    self.stats = OrderedDict()
+
+  # The (family, sockaddr) pairs to try, best first, less those in avoid
+  def order(self, addresses, avoid):
+    now = time.monotonic()
+    healthy = []
+    ejected = []
+    for address in addresses:
+      if address[1] in avoid:
+        continue
+      stats = self.stats.get(address[1])
+      if stats is not None and stats.ejectedUntil > now:
+        ejected.append(address)
+      else:
+        healthy.append(address)
+    # The sort is stable, so equal addresses keep their happy-eyeballs order
+    healthy.sort(key=self.score)
+    return healthy + ejected
+
+  def score(self, address):
+    stats = self.stats.get(address[1])
+    return (stats.outstanding + 1) * stats.latency if stats is not None else 0.0
+
+  def started(self, sockaddr):
+    if sockaddr is None:
+      return
+    stats = self.stats.get(sockaddr)
+    if stats is None:
+      stats = self.stats[sockaddr] = AddressStats()
+      if len(self.stats) > BALANCER_ADDRESSES:
+        self.stats.popitem(last=False)
+    else:
+      self.stats.move_to_end(sockaddr)
+    stats.outstanding += 1
+
+  # An attempt on the address answered after latency seconds; healthy
+  # when that was a response rather than just a connection
+  def succeeded(self, sockaddr, latency, healthy=True):
+    stats = self.stats.get(sockaddr)
+    if stats is None:
+      return
+    stats.outstanding -= 1
+    stats.latency = latency if not stats.latency else stats.latency + BALANCER_DECAY * (latency - stats.latency)
+    if healthy:
+      stats.fails = 0
+
+  def failed(self, sockaddr):
+    stats = self.stats.get(sockaddr)
+    if stats is None:
+      return
+    stats.outstanding -= 1
+    stats.fails += 1
+    if stats.fails >= self.maxFails:
+      if stats.ejectedUntil <= time.monotonic():
+        log.warning('Origin address ejected', address=sockaddr[0], port=sockaddr[1], fails=stats.fails)
+        metrics.count('origin_ejections')
+      stats.ejectedUntil = time.monotonic() + self.ejectTime
+
+  # The attempt ended in a way that says nothing about the address
+  def abandoned(self, sockaddr):
+    stats = self.stats.get(sockaddr)
+    if stats is not None:
+      stats.outstanding -= 1
+
+originBalancer = OriginBalancer(args.origin_max_fails, args.origin_eject_time)
+
+# The address a connected socket went to, or None when that is unknown
+def peerAddress(sock):
+  try:
+    return sock.getpeername()
+  except OSError:
+    return None
+
+# Open a non-blocking socket and connect it to one address
+async def connectAddress(family, sockaddr):
+  loop = asyncio.get_running_loop()
+  # Create a socket to connect to origin server
+  # and store in originServerSocket
   # ~~~~ INSERT CODE ~~~~
-   message_bytes = clientSocket.recv(BUFFER_SIZE)
+  originServerSocket = socket.socket(family, socket.SOCK_STREAM)
+  originServerSocket.setblocking(False)
   # ~~~~ END CODE INSERT ~~~~
-  message = message_bytes.decode('utf-8')
-  print ('Received request:')
-  print ('< ' + message)
+  originBalancer.started(sockaddr)
+  started = time.monotonic()
+  try:
+    tuneSocketBuffers(originServerSocket)
+    tuneConnection(originServerSocket)
+    # The request rides on the SYN; a failed connection then only shows
+    # when the request is sent
+    if args.origin_fastopen and TCP_FASTOPEN_CONNECT is not None:
+      originServerSocket.setsockopt(socket.IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1)
+    # Connect to the origin server
+    # ~~~~ INSERT CODE ~~~~
+    await loop.sock_connect(originServerSocket, sockaddr)
+    # ~~~~ END CODE INSERT ~~~~
+  except BaseException as err:
+    # Losing the race to another address is no fault of this one, unless
+    # it had already taken longer than a connection should
+    if isinstance(err, OSError) or time.monotonic() - started >= HAPPY_EYEBALLS_DELAY:
+      originBalancer.failed(sockaddr)
+    else:
+      originBalancer.abandoned(sockaddr)
+    originServerSocket.close()
+    raise
+  originBalancer.succeeded(sockaddr, time.monotonic() - started, healthy=False)
+  return originServerSocket
+
+# Split an authority such as example.com:8080 or [::1]:8080 into its host
+# and port, which is defaultPort when it names none. Raises ValueError
+# when either part is not usable.
+def splitHostPort(authority, defaultPort):
+  if authority.startswith('['):
+    end = authority.find(']')
+    if end < 0:
+      raise ValueError('unterminated IPv6 address')
+    host = authority[1:end]
+    rest = authority[end + 1:]
+    if rest and not rest.startswith(':'):
+      raise ValueError('junk after IPv6 address')
+    port = rest[1:]
+  else:
+    host, sep, port = authority.partition(':')
+  if not host:
+    raise ValueError('no host')
+  if not port:
+    return host, defaultPort
+  if not port.isdigit() or not 0 < int(port) < 65536:
+    raise ValueError('bad port')
+  return host, int(port)
+
+# Resolve an origin hostname and open a connection to it. The addresses
+# not in avoid are tried best first, as the balancer ranks them, and
+# raced happy-eyeballs style: each further attempt starts when the
+# previous one fails or HAPPY_EYEBALLS_DELAY seconds pass without it
+# connecting, and the first connection to succeed is used.
+async def connectToOrigin(hostname, port=80, avoid=()):
+  # Get the IP addresses for a hostname
+  started = time.monotonic()
+  addresses = originBalancer.order(await dnsCache.resolve(hostname, port), avoid)
+  connectStarted = time.monotonic()
+  metrics.observe('dns', connectStarted - started)
+
+  attempts = []
+  lastError = None
+  try:
+    for family, sockaddr in addresses:
+      attempt = asyncio.ensure_future(connectAddress(family, sockaddr))
+      attempts.append(attempt)
+      done, running = await asyncio.wait(attempts, timeout=HAPPY_EYEBALLS_DELAY,
+                                          return_when=asyncio.FIRST_COMPLETED)
+      for finished in done:
+        attempts.remove(finished)
+        if finished.exception() is None:
+          return finished.result()
+        lastError = finished.exception()
+
+    # Every attempt has started; take the first that succeeds
+    while attempts:
+      done, running = await asyncio.wait(attempts, return_when=asyncio.FIRST_COMPLETED)
+      for finished in done:
+        attempts.remove(finished)
+        if finished.exception() is None:
+          return finished.result()
+        lastError = finished.exception()
+  finally:
+    metrics.observe('connect', time.monotonic() - connectStarted)
+    # Drop the attempts that lost the race, including ones that connected
+    # in the same instant as the winner
+    for attempt in attempts:
+      attempt.cancel()
+      attempt.add_done_callback(closeLostAttempt)
+  raise lastError or OSError('no addresses for ' + hostname)
+
+def closeLostAttempt(attempt):
+  if not attempt.cancelled() and attempt.exception() is None:
+    attempt.result().close()
+
+# Deadlines of every connection on one hashed timer wheel. A timeout sits
+# in the slot of the tick it expires on, so starting, restarting and
+# stopping one are set operations however many connections there are,
+# and a single loop callback each tick expires the ones that are due.
+# Timeouts fire up to one tick late. The wheel only ticks while it holds
+# any.
+class TimerWheel:
+  def __init__(self, tick, size):
+    self.tick = tick
+    self.slots = [set() for i in range(size)]
+    self.current = 0
+    self.timers = 0
+    self.handle = None
+
+  def schedule(self, timer, seconds):
+    now = int(time.monotonic() / self.tick)
+    if self.handle is None:
+      self.current = now
+      self.handle = asyncio.get_running_loop().call_later(self.tick, self.advance)
+    timer.due = now + max(math.ceil(seconds / self.tick), 1)
+    self.slots[timer.due % len(self.slots)].add(timer)
+    self.timers += 1
+
+  def cancel(self, timer):
+    if timer.due is not None:
+      self.slots[timer.due % len(self.slots)].discard(timer)
+      timer.due = None
+      self.timers -= 1
+
+  def advance(self):
+    now = int(time.monotonic() / self.tick)
+    while self.current < now and self.timers:
+      self.current += 1
+      slot = self.slots[self.current % len(self.slots)]
+      for timer in [timer for timer in slot if timer.due <= self.current]:
+        self.cancel(timer)
+        timer.expire()
+    self.current = now
+    if self.timers:
+      self.handle = asyncio.get_running_loop().call_later(self.tick, self.advance)
+    else:
+      self.handle = None
+
+timerWheel = TimerWheel(TIMER_TICK, TIMER_SLOTS)
+
+# Raised where a phase of a request ran out of time
+class RequestTimeout(Exception):
+  def __init__(self, phase):
+    super().__init__(phase + ' timed out')
+    self.phase = phase
+
+# Bounds the time the task spends in a with block. When it runs out the
+# task is cancelled, and the cancellation comes out of the block as a
+# RequestTimeout for phase. Blocks nest, the innermost to run out wins.
+class Timeout:
+  __slots__ = ('phase', 'seconds', 'task', 'due', 'expired')
+
+  def __init__(self, phase, seconds):
+    self.phase = phase
+    self.seconds = seconds
+    self.task = None
+    self.due = None
+    self.expired = False
+
+  def __enter__(self):
+    self.task = asyncio.current_task()
+    timerWheel.schedule(self, self.seconds)
+    return self
+
+  def __exit__(self, kind, value, traceback):
+    timerWheel.cancel(self)
+    if self.expired and kind is asyncio.CancelledError and self.task.uncancel() == 0:
+      raise RequestTimeout(self.phase) from value
+
+  # Start counting again, for a phase that lasts while there is progress
+  def restart(self):
+    timerWheel.cancel(self)
+    timerWheel.schedule(self, self.seconds)
+
+  def expire(self):
+    self.expired = True
+    self.task.cancel()
+
+# Token buckets of rate requests a second and burst at once, one per key,
+# refilled lazily when a key is next seen so each request costs O(1)
+class RateLimiter:
+  def __init__(self, rate, burst):
+    self.rate = rate
+    self.burst = max(burst if burst > 0 else rate, 1)
+    self.buckets = OrderedDict()
+
+  # Take a token for key if one is there within maxDelay seconds. Returns
+  # (taken, seconds until the token is there), nothing taken when not.
+  def reserve(self, key, maxDelay):
+    now = time.monotonic()
+    bucket = self.buckets.get(key)
+    if bucket is None:
+      bucket = self.buckets[key] = [self.burst, now]
+      if len(self.buckets) > RATE_LIMIT_KEYS:
+        self.buckets.popitem(last=False)
+    else:
+      self.buckets.move_to_end(key)
+      bucket[0] = min(self.burst, bucket[0] + (now - bucket[1]) * self.rate)
+      bucket[1] = now
+    delay = max(1 - bucket[0], 0) / self.rate
+    if delay > maxDelay:
+      return False, delay
+    # A token taken ahead of its time leaves the bucket in debt
+    bucket[0] -= 1
+    return True, delay
+
+# Caps the connections or requests open at a time per key. Waiters are
+# queued per key and handed a slot, in order, as one is released.
+class ConcurrencyLimiter:
+  def __init__(self, limit):
+    self.limit = limit
+    self.active = {}
+    self.waiters = {}
+
+  def tryAcquire(self, key):
+    active = self.active.get(key, 0)
+    if active >= self.limit:
+      return False
+    self.active[key] = active + 1
+    return True
+
+  # Wait up to timeout seconds for a slot. Returns whether one was had.
+  async def acquire(self, key, timeout):
+    if self.tryAcquire(key):
+      return True
+    if timeout <= 0:
+      return False
+    waiter = asyncio.get_running_loop().create_future()
+    self.waiters.setdefault(key, collections.deque()).append(waiter)
+    try:
+      with Timeout('queue', timeout):
+        await waiter
+      return True
+    except RequestTimeout:
+      # A slot handed over just as time ran out goes to the next waiter
+      if waiter.done() and not waiter.cancelled():
+        self.release(key)
+      return False
+
+  def release(self, key):
+    waiters = self.waiters.get(key)
+    while waiters:
+      waiter = waiters.popleft()
+      if not waiter.done():
+        waiter.set_result(None)
+        return
+    self.waiters.pop(key, None)
+    active = self.active[key] - 1
+    if active:
+      self.active[key] = active
+    else:
+      del self.active[key]
+
+clientRate = RateLimiter(args.client_rate, args.client_burst) if args.client_rate > 0 else None
+clientConnections = ConcurrencyLimiter(args.client_connections) if args.client_connections > 0 else None
+originRate = RateLimiter(args.origin_rate, args.origin_burst) if args.origin_rate > 0 else None
+originConnections = ConcurrencyLimiter(args.origin_connections) if args.origin_connections > 0 else None
+
+# A request turned away by a limit, to be answered with status and a
+# Retry-After of retryAfter seconds
+class Overloaded(Exception):
+  def __init__(self, status, limit, retryAfter):
+    super().__init__(limit + ' limit reached')
+    self.status = status
+    self.limit = limit
+    self.retryAfter = retryAfter
+
+# Hold a request back for the client rate of address, or raise
+# Overloaded when it would have to wait longer than CLIENT_RATE_DELAY
+async def admitClientRequest(address):
+  if clientRate is None:
+    return
+  taken, delay = clientRate.reserve(address, CLIENT_RATE_DELAY)
+  if not taken:
+    raise Overloaded(429, 'client rate', delay)
+  if delay:
+    await asyncio.sleep(delay)
+
+# Wait for the rate and connection limits of an origin, up to
+# ORIGIN_QUEUE_TIMEOUT seconds, or raise Overloaded. Once admitted the
+# request holds one of the origin's slots until leaveOrigin.
+async def admitToOrigin(origin):
+  if originRate is not None:
+    taken, delay = originRate.reserve(origin, ORIGIN_QUEUE_TIMEOUT)
+    if not taken:
+      raise Overloaded(503, 'origin rate', delay)
+    if delay:
+      await asyncio.sleep(delay)
+  if originConnections is not None and not await originConnections.acquire(origin, ORIGIN_QUEUE_TIMEOUT):
+    raise Overloaded(503, 'origin connections', 1)
+
+def leaveOrigin(origin):
+  if originConnections is not None:
+    originConnections.release(origin)
+
+# Send data to a client, which has CLIENT_SEND_TIMEOUT seconds to take it
+async def sendToClient(clientSocket, data):
+  with Timeout('send', CLIENT_SEND_TIMEOUT):
+    await asyncio.get_running_loop().sock_sendall(clientSocket, data)
+
+# Send count bytes of file from offset to a client with sendfile, in
+# segments that each have to go within CLIENT_SEND_TIMEOUT seconds.
+# Returns the number of bytes sent, which falls short if the file does.
+async def sendFileToClient(clientSocket, file, offset, count):
+  loop = asyncio.get_running_loop()
+  sent = 0
+  while sent < count:
+    with Timeout('send', CLIENT_SEND_TIMEOUT):
+      segment = await loop.sock_sendfile(clientSocket, file, offset + sent, min(count - sent, SENDFILE_SEGMENT))
+    if not segment:
+      break
+    sent += segment
+  return sent
+
+# Incremental parser for the requests arriving on one client connection.
+# Received bytes collect in one pooled buffer that is reused for every
+# request and returned to the pool whenever the connection has nothing
+# buffered. Only newly arrived bytes are scanned for the blank line ending
+# the head, headers are kept as offsets into the buffer and decoded when
+# looked up, and the body is handed out as views of the buffer while it
+# streams in.
+class RequestParser:
+  def __init__(self, clientSocket):
+    self.clientSocket = clientSocket
+    self.buffer = None
+    self.length = 0
+    # Requests answered on the connection so far
+    self.answered = 0
+    self.reset()
+
+  def reset(self):
+    self.method = None
+    self.uri = None
+    self.version = None
+    self.fields = []
+    self.headEnd = 0
+    self.bodyPos = 0
+    self.bodyRemaining = 0
+    self.chunks = None
+    self.hasBody = False
+    self.bodyDone = True
+    self.firstByteTime = None
+    # What the request was answered with, for the access log
+    self.responseStatus = None
+    self.responseBytes = 0
+    self.cacheStatus = None
+
+  # Receive whatever the client sends next into the free end of the
+  # buffer. A full buffer moves up a size class until it reaches
+  # CONNECTION_BUFFER_CAP. Returns False once the client closes.
+  async def receive(self):
+    loop = asyncio.get_running_loop()
+    if self.buffer is None:
+      self.buffer = bufferPool.acquire(BUFFER_SIZE_CLASSES[0])
+    elif self.length == len(self.buffer):
+      if self.length >= CONNECTION_BUFFER_CAP:
+        raise ValueError('request head larger than the connection buffer')
+      bigger = bufferPool.acquire(min(self.length * 2, CONNECTION_BUFFER_CAP))
+      bigger[:self.length] = self.buffer
+      bufferPool.release(self.buffer)
+      self.buffer = bigger
+
+    # Get HTTP request from client
+    # and store it in the variable: message_bytes
+    # ~~~~ INSERT CODE ~~~~
+    message_bytes = memoryview(self.buffer)[self.length:]
+    try:
+      received = await loop.sock_recv_into(self.clientSocket, message_bytes)
+    finally:
+      message_bytes.release()
+    # ~~~~ END CODE INSERT ~~~~
+    self.length += received
+    return received > 0
+
+  # Wait for the next request head and parse it. Returns False when the
+  # client goes away first and raises ValueError for a malformed head.
+  # The connection may idle for CLIENT_IDLE_TIMEOUT seconds before the
+  # head starts, which then has to arrive in full within
+  # CLIENT_HEADER_TIMEOUT however slowly its bytes trickle in.
+  async def readHead(self):
+    self.reset()
+    if not self.length:
+      # A draining worker takes no more requests on a kept-alive
+      # connection that has none under way, and cuts short the waits for one
+      if draining and self.answered:
+        return False
+      with Timeout('idle', CLIENT_IDLE_TIMEOUT) as idle:
+        if self.answered:
+          idleTimeouts.add(idle)
+        try:
+          if not await self.receive():
+            return False
+        finally:
+          idleTimeouts.discard(idle)
+    self.firstByteTime = time.monotonic()
+    scanned = 0
+    with Timeout('head', CLIENT_HEADER_TIMEOUT):
+      while True:
+        end = self.buffer.find(b'\r\n\r\n', scanned, self.length)
+        if end >= 0:
+          break
+        scanned = max(self.length - 3, 0)
+        if not await self.receive():
+          return False
+    metrics.observe('parse', time.monotonic() - self.firstByteTime)
+    self.headEnd = end + 4
+    self.bodyPos = self.headEnd
+
+    buffer = self.buffer
+    lineEnd = buffer.find(b'\r\n', 0, end + 2)
+    requestParts = buffer[:lineEnd].decode('latin-1').split()
+    if len(requestParts) != 3:
+      raise ValueError('malformed request line')
+    self.method, self.uri, self.version = requestParts
+
+    # Record (nameStart, nameEnd, valueStart, valueEnd) for every header
+    pos = lineEnd + 2
+    while pos < end:
+      lineEnd = buffer.find(b'\r\n', pos, end + 2)
+      colon = buffer.find(b':', pos, lineEnd)
+      if colon > pos:
+        if buffer[colon - 1] in b' \t':
+          raise ValueError('whitespace before colon')
+        valueStart = colon + 1
+        valueEnd = lineEnd
+        while valueStart < valueEnd and buffer[valueStart] in b' \t':
+          valueStart += 1
+        while valueEnd > valueStart and buffer[valueEnd - 1] in b' \t':
+          valueEnd -= 1
+        self.fields.append((pos, colon, valueStart, valueEnd))
+      pos = lineEnd + 2
+
+    # A body framed two ways, or with lengths that disagree, could end in
+    # one place for the proxy and another for the origin, so it is refused
+    transferEncodings = self.headerValues(b'transfer-encoding')
+    contentLengths = {value.strip() for line in self.headerValues(b'content-length') for value in line.split(',')}
+    if transferEncodings:
+      if ', '.join(transferEncodings).lower() != 'chunked':
+        raise ValueError('unsupported transfer-encoding')
+      if contentLengths:
+        raise ValueError('both transfer-encoding and content-length')
+      self.chunks = ChunkedFramer()
+      self.bodyDone = False
+    else:
+      if len(contentLengths) > 1:
+        raise ValueError('conflicting content-length')
+      contentLength = contentLengths.pop() if contentLengths else '0'
+      if not re.fullmatch(r'[0-9]+', contentLength):
+        raise ValueError('malformed content-length')
+      self.bodyRemaining = int(contentLength)
+      self.bodyDone = self.bodyRemaining == 0
+    self.hasBody = not self.bodyDone
+    return True
+
+  # Value of the first header called name (lowercase bytes)
+  def header(self, name, default=None):
+    buffer = self.buffer
+    for nameStart, nameEnd, valueStart, valueEnd in self.fields:
+      if nameEnd - nameStart == len(name) and buffer[nameStart:nameEnd].lower() == name:
+        return buffer[valueStart:valueEnd].decode('latin-1')
+    return default
+
+  # Values of every header called name (lowercase bytes), in order
+  def headerValues(self, name):
+    buffer = self.buffer
+    return [buffer[valueStart:valueEnd].decode('latin-1')
+            for nameStart, nameEnd, valueStart, valueEnd in self.fields
+            if nameEnd - nameStart == len(name) and buffer[nameStart:nameEnd].lower() == name]
+
+  # Every header line as (lowercase name, view of the line in the buffer
+  # without its CRLF). The views are only valid until the next request.
+  def fieldLines(self):
+    with memoryview(self.buffer) as view:
+      return [(bytes(view[nameStart:nameEnd]).lower(), view[nameStart:valueEnd])
+              for nameStart, nameEnd, valueStart, valueEnd in self.fields]
+
+  # Yield the request body as it arrives, exactly as the client framed it.
+  # Each view is only valid until the next one is requested.
+  async def readBody(self):
+    while not self.bodyDone:
+      if self.bodyPos == self.length:
+        # Everything buffered has been handed out: reuse the space
+        self.length = self.headEnd
+        self.bodyPos = self.headEnd
+        with Timeout('body', CLIENT_BODY_TIMEOUT):
+          if not await self.receive():
+            raise ConnectionError('client closed the connection mid-body')
+      start = self.bodyPos
+      if self.chunks is not None:
+        self.bodyPos = self.chunks.feed(self.buffer, start, self.length)
+        self.bodyDone = self.chunks.done
+      else:
+        self.bodyPos = min(start + self.bodyRemaining, self.length)
+        self.bodyRemaining -= self.bodyPos - start
+        self.bodyDone = self.bodyRemaining == 0
+      view = memoryview(self.buffer)[start:self.bodyPos]
+      try:
+        yield view
+      finally:
+        view.release()
+
+  # Read past whatever is left of the body. Returns False if the client
+  # went away before it ended.
+  async def skipBody(self):
+    try:
+      async for data in self.readBody():
+        pass
+    except (OSError, ValueError, RequestTimeout):
+      return False
+    return True
+
+  # Drop the finished request so the next one starts the buffer. An empty
+  # buffer goes back to the pool while the connection waits.
+  def consume(self):
+    self.answered += 1
+    remaining = self.length - self.bodyPos
+    if remaining:
+      with memoryview(self.buffer) as view:
+        view[:remaining] = view[self.bodyPos:self.length]
+    self.length = remaining
+    self.bodyPos = 0
+    self.headEnd = 0
+    if not remaining:
+      self.close()
+
+  # Hand over whatever arrived after the request head, for a connection
+  # that stops speaking HTTP after it
+  def takeBuffered(self):
+    data = bytes(self.buffer[self.headEnd:self.length])
+    self.close()
+    return data
+
+  def close(self):
+    if self.buffer is not None:
+      bufferPool.release(self.buffer)
+      self.buffer = None
+      self.length = 0
+
+BAD_REQUEST_RESPONSE = b'HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n'
+FORBIDDEN_RESPONSE = b'HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n'
+NOT_IMPLEMENTED_RESPONSE = b'HTTP/1.1 501 Not Implemented\r\nContent-Length: 0\r\n\r\n'
+BAD_GATEWAY_RESPONSE = b'HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n'
+REQUEST_TIMEOUT_RESPONSE = b'HTTP/1.1 408 Request Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n'
+GATEWAY_TIMEOUT_RESPONSE = b'HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n'
+
+# Serve one client connection. Every socket operation is awaited on the
+# event loop so a slow client or origin only stalls its own connection.
+# The connection stays open for further, possibly pipelined, requests for
+# as long as both the client and each response allow it.
+async def handleClient(clientSocket, clientAddress, acceptedAt):
+  request = RequestParser(clientSocket)
+  # A client over its connection limit gets each of its requests refused
+  admitted = clientConnections is None or clientConnections.tryAcquire(clientAddress[0])
+  try:
+    while True:
+      try:
+        if not await request.readHead():
+          return
+      except ValueError:
+        log.warning('Malformed request', client=clientAddress[0])
+        metrics.count('bad_requests')
+        await sendToClient(clientSocket, BAD_REQUEST_RESPONSE)
+        return
+      except RequestTimeout as timeout:
+        # An idle keep-alive connection is simply closed
+        if timeout.phase == 'head':
+          log.warning('Request head timed out', client=clientAddress[0])
+          metrics.count('timeouts')
+          await sendToClient(clientSocket, REQUEST_TIMEOUT_RESPONSE)
+        return
+      if acceptedAt is not None:
+        # From accepting the connection to its first request arriving
+        metrics.observe('accept', request.firstByteTime - acceptedAt)
+        acceptedAt = None
+      log.sample()
+      try:
+        if not admitted:
+          raise Overloaded(429, 'client connections', 1)
+        await admitClientRequest(clientAddress[0])
+        keepAlive = await handleRequest(clientSocket, clientAddress, request)
+      except RequestTimeout as timeout:
+        keepAlive = await timedOut(clientSocket, clientAddress, request, timeout.phase)
+      except Overloaded as overload:
+        keepAlive = await refused(clientSocket, clientAddress, request, overload) and admitted
+      finally:
+        log.access(client=clientAddress[0], method=request.method, uri=request.uri,
+                   status=request.responseStatus, bytes=request.responseBytes, cache=request.cacheStatus,
+                   ms=(time.monotonic() - request.firstByteTime) * 1000)
+      # Any body the handler did not forward still has to be read past
+      # before the next request can be parsed
+      if not keepAlive or not await request.skipBody():
+        return
+      request.consume()
+  finally:
+    request.close()
+    if admitted and clientConnections is not None:
+      clientConnections.release(clientAddress[0])
+
+# Answer a request that ran out of time in phase, if nothing of the
+# response has been sent yet. The connection is closed either way.
+async def timedOut(clientSocket, clientAddress, request, phase):
+  log.warning('Request timed out', client=clientAddress[0], uri=request.uri, phase=phase)
+  metrics.count('timeouts')
+  if phase in ('connect', 'origin'):
+    request.responseStatus = 504
+    await sendToClient(clientSocket, GATEWAY_TIMEOUT_RESPONSE)
+  elif phase == 'body':
+    request.responseStatus = 408
+    await sendToClient(clientSocket, REQUEST_TIMEOUT_RESPONSE)
+  return False
+
+# Answer a request a limit turned away, before anything else was sent
+async def refused(clientSocket, clientAddress, request, overload):
+  log.debug('Request refused', client=clientAddress[0], uri=request.uri, limit=overload.limit)
+  metrics.count('rate_limited')
+  request.responseStatus = overload.status
+  reason = 'Too Many Requests' if overload.status == 429 else 'Service Unavailable'
+  head = ('HTTP/1.1 ' + str(overload.status) + ' ' + reason + '\r\nRetry-After: ' +
+          str(max(math.ceil(overload.retryAfter), 1)) + '\r\nContent-Length: 0\r\n\r\n')
+  await sendToClient(clientSocket, head.encode('latin-1'))
+  return True
+
+# Response statuses a shared cache may store without explicit freshness
+HEURISTIC_STATUSES = (200, 203, 204, 206, 300, 301, 308, 404, 405, 410, 414, 501)
+
+# Longest freshness lifetime guessed from Last-Modified, in seconds
+HEURISTIC_FRESHNESS_MAX = 86400
+
+# Split a Cache-Control value into a dict of directive -> argument or None
+def parseCacheControl(value):
+  directives = {}
+  for part in value.split(','):
+    name, sep, argument = part.strip().partition('=')
+    if name:
+      directives[name.lower()] = argument.strip('"') if sep else None
+  return directives
+
+# Seconds since the epoch for an HTTP date, or None when it is not one
+def parseHttpDate(value):
+  try:
+    return email.utils.parsedate_to_datetime(value).timestamp()
+  except (TypeError, ValueError, IndexError):
+    return None
+
+# Seconds named by a delta-seconds directive argument, 0 when malformed
+def deltaSeconds(value):
+  try:
+    return max(int(value), 0)
+  except (TypeError, ValueError):
+    return 0
+
+# Replace, add or (with a value of None) remove header fields in a
+# response head given as a string ending in a blank line
+def replaceHeaders(head, updates):
+  lines = head.split('\r\n')[:-2]
+  kept = [lines[0]]
+  for line in lines[1:]:
+    if line.partition(':')[0].strip().lower() not in updates:
+      kept.append(line)
+  for name, value in updates.items():
+    if value is not None:
+      kept.append('-'.join(part.capitalize() for part in name.split('-')) + ': ' + value)
+  return '\r\n'.join(kept) + '\r\n\r\n'
+
+# The head of an origin response as it is stored: without its hop-by-hop
+# headers and those its Connection header names, and for a chunked body,
+# which is stored de-chunked, without its framing
+def storedResponseHead(framer, updates={}):
+  dropped = {name.decode('latin-1') for name in HOP_BY_HOP_HEADERS}
+  dropped |= {name.strip() for name in framer.headers.get('connection', '').lower().split(',')}
+  if framer.chunks is not None:
+    dropped.add('content-length')
+  return replaceHeaders(framer.head.decode('latin-1'), dict(dict.fromkeys(dropped), **updates))
+
+# Freshness and validation state of one stored response, following
+# RFC 9111. The response head is kept here, apart from the body in the
+# cache file, so a 304 can refresh it without the body being rewritten.
+# It is kept in the cache index under the URL's key, with the location
+# of its body file.
+class CacheEntry:
+  def __init__(self, key, location, head, requestTime, responseTime, varyValues):
+    self.key = key
+    self.location = location
+    self.head = head
+    self.requestTime = requestTime
+    self.responseTime = responseTime
+    self.varyValues = varyValues
+    self.bodySize = 0
+    # For a variant in another coding, the body file it was made from
+    self.source = None
+    # Use of the entry, for the eviction policy
+    self.hits = 0
+    self.lastAccess = responseTime
+    self.priority = 0
+
+  # The fields parse() fills in are only worked out when first used, so
+  # loading a large index does not parse every stored head
+  def __getattr__(self, name):
+    if name not in ('status', 'headers', 'selfDelimiting', 'directives', 'initialAge', 'lifetime', 'coding'):
+      raise AttributeError(name)
+    self.parse()
+    return self.__dict__[name]
+
+  def parse(self):
+    framer = ResponseFramer('GET')
+    framer.feed(self.head.encode('latin-1'))
+    self.status = framer.status
+    self.headers = framer.headers
+    # Whether the stored head says where the body ends; a Connection
+    # header is never stored, so the framing alone tells
+    self.selfDelimiting = framer.done or framer.chunks is not None or framer.remaining is not None
+    self.directives = parseCacheControl(self.headers.get('cache-control', ''))
+    self.coding = contentCoding(self.headers)
+
+    # Age the response already had when it arrived
+    dateValue = parseHttpDate(self.headers.get('date')) or self.responseTime
+    apparentAge = max(self.responseTime - dateValue, 0)
+    responseDelay = self.responseTime - self.requestTime
+    self.initialAge = max(apparentAge, deltaSeconds(self.headers.get('age')) + responseDelay)
+
+    # How long it stays fresh: explicit lifetime first, then a heuristic
+    if 's-maxage' in self.directives:
+      self.lifetime = deltaSeconds(self.directives['s-maxage'])
+    elif 'max-age' in self.directives:
+      self.lifetime = deltaSeconds(self.directives['max-age'])
+    elif 'expires' in self.headers:
+      expires = parseHttpDate(self.headers['expires'])
+      self.lifetime = max(expires - dateValue, 0) if expires is not None else 0
+    else:
+      lastModified = parseHttpDate(self.headers.get('last-modified'))
+      if lastModified is not None and self.status in HEURISTIC_STATUSES:
+        self.lifetime = min(max(dateValue - lastModified, 0) / 10, HEURISTIC_FRESHNESS_MAX)
+      else:
+        self.lifetime = 0
+
+  def age(self, now):
+    return self.initialAge + now - self.responseTime
+
+  # Whether the entry may answer a request carrying requestDirectives
+  # without asking the origin
+  def isFresh(self, requestDirectives, now):
+    if 'no-cache' in self.directives or 'no-cache' in requestDirectives:
+      return False
+    age = self.age(now)
+    if 'max-age' in requestDirectives and age > deltaSeconds(requestDirectives['max-age']):
+      return False
+    return age < self.lifetime
+
+  # Whether the expired entry may still answer a request carrying
+  # requestDirectives, under the stale-while-revalidate or stale-if-error
+  # directive (RFC 5861) or, when the response has none, for default
+  # seconds past expiry. Directives that demand revalidation forbid it.
+  def mayServeStale(self, requestDirectives, now, directive, default):
+    if any(name in self.directives for name in ('no-cache', 'must-revalidate', 'proxy-revalidate', 's-maxage')):
+      return False
+    if 'no-cache' in requestDirectives or 'max-age' in requestDirectives:
+      return False
+    window = deltaSeconds(self.directives[directive]) if directive in self.directives else default
+    if directive == 'stale-if-error' and directive in requestDirectives:
+      window = deltaSeconds(requestDirectives[directive])
+    return self.age(now) - self.lifetime < window
+
+  # Conditional request headers that let the origin answer 304
+  def validators(self):
+    lines = ''
+    if 'etag' in self.headers:
+      lines += '\r\nIf-None-Match: ' + self.headers['etag']
+    if 'last-modified' in self.headers:
+      lines += '\r\nIf-Modified-Since: ' + self.headers['last-modified']
+    return lines
+
+  # Whether request sends the same values for the headers this response
+  # varies on as the request it was stored for
+  def matchesVary(self, request):
+    for name, value in self.varyValues.items():
+      if request.header(name.encode('latin-1')) != value:
+        return False
+    return True
+
+  # Fold the headers of a 304 into the stored head and restart the age
+  def refresh(self, framer, requestTime, responseTime):
+    updates = {}
+    for name, value in framer.headers.items():
+      if name not in ('content-length', 'transfer-encoding', 'connection', 'keep-alive'):
+        updates[name] = value
+    self.head = replaceHeaders(self.head, updates)
+    self.requestTime = requestTime
+    self.responseTime = responseTime
+    self.parse()
+
+  # The head to send a client now, carrying the current Age and any other
+  # header updates
+  def responseHead(self, now, updates={}):
+    return replaceHeaders(self.head, dict(updates, age=str(int(self.age(now))))).encode('latin-1')
+
+  # Take over the head of a newer record for the same body
+  def assign(self, other):
+    self.head = other.head
+    self.requestTime = other.requestTime
+    self.responseTime = other.responseTime
+    self.varyValues = other.varyValues
+    self.parse()
+
+  # The cache index line for this entry
+  def record(self):
+    return {'key': self.key, 'location': self.location, 'head': self.head,
+            'requestTime': self.requestTime, 'responseTime': self.responseTime,
+            'vary': self.varyValues, 'bodySize': self.bodySize, 'source': self.source,
+            'hits': self.hits, 'lastAccess': self.lastAccess}
+
+  @staticmethod
+  def fromRecord(record):
+    entry = CacheEntry(record['key'], record['location'], record['head'],
+                       record['requestTime'], record['responseTime'], record['vary'])
+    entry.bodySize = record['bodySize']
+    entry.source = record.get('source')
+    entry.hits = record.get('hits', 0)
+    entry.lastAccess = record.get('lastAccess', entry.responseTime)
+    return entry
+
+# Moves cache file I/O off the event loop onto one writer thread per
+# worker. Everything is written under a temporary name beside its final
+# location and renamed into place once complete, so readers and crashes
+# only ever see whole objects. fsyncPolicy decides what reaches the disk
+# before a rename: 'none', the file data ('data'), or the data and the
+# directory entry ('full').
+class CacheWriter:
+  def __init__(self, fsyncPolicy, backlogBytes):
+    self.fsyncPolicy = fsyncPolicy
+    self.backlogBytes = backlogBytes
+    self.queue = queue.SimpleQueue()
+    self.loop = None
+    self.tempCounter = 0
+    # Held by the writer thread while it runs a task, so a fork can wait for it
+    self.busy = threading.Lock()
+
+  # Start the writer thread; results are reported back on loop
+  def start(self, loop):
+    self.loop = loop
+    threading.Thread(target=self.run, name='cache-writer', daemon=True).start()
+
+  def run(self):
+    while True:
+      function, arguments = self.queue.get()
+      with self.busy:
+        try:
+          function(*arguments)
+        except Exception as err:
+          log.error('Cache write failed', error=err)
+
+  # Run function(*arguments) on the writer thread, after everything
+  # submitted before it
+  def submit(self, function, *arguments):
+    self.queue.put((function, arguments))
+
+  # Run function(*arguments) back on the event loop
+  def callback(self, function, *arguments):
+    self.loop.call_soon_threadsafe(function, *arguments)
+
+  # Wait for everything submitted so far to be done
+  async def flush(self):
+    done = self.loop.create_future()
+    self.submit(self.callback, done.set_result, None)
+    await done
+
+  def tempLocation(self, location):
+    self.tempCounter += 1
+    return location + '#tmp-' + str(os.getpid()) + '-' + str(self.tempCounter)
+
+  # Make a finished temporary file durable as the policy asks and rename
+  # it over location (writer thread)
+  def install(self, fd, tempLocation, location):
+    if self.fsyncPolicy != 'none':
+      os.fsync(fd)
+    os.replace(tempLocation, location)
+    if self.fsyncPolicy == 'full':
+      directoryFd = os.open(os.path.dirname(location) or '.', os.O_RDONLY)
+      try:
+        os.fsync(directoryFd)
+      finally:
+        os.close(directoryFd)
+
+  # Remove files that may not exist (writer thread)
+  def removeFiles(self, *locations):
+    for location in locations:
+      try:
+        os.remove(location)
+      except FileNotFoundError:
+        pass
+
+cacheWriter = CacheWriter(args.cache_fsync, args.cache_write_backlog)
+
+# Which stored response each URL has, with its head, body size and body
+# file, so a lookup takes no file system calls beyond opening the body.
+# The index is persisted as a journal of JSON lines, one per change,
+# appended by the cache writer once the body it names is in place.
+# Workers share the journal and pick up each other's changes by reading
+# its tail. A checkpoint holds one line per stored response as of a
+# journal position, so startup reads the checkpoint and the journal
+# after it rather than the whole history or the cache tree.
+# A proxy started by a graceful restart also follows the journals of the
+# process it replaces, which go on changing while its workers drain, and
+# leaves the checkpoint and the sweep for orphaned files until that
+# process is gone.
+# The index also keeps the cache within maxBytes of bodies and maxObjects
+# responses, evicting by policy: least recently used ('lru'), least
+# frequently used ('lfu') or GreedyDual-Size-Frequency ('gdsf'), which
+# weighs hits against size so large, rarely used bodies go first.
+class CacheIndex:
+  def __init__(self, cacheDir, maxBytes, maxObjects, policy):
+    self.cacheDir = cacheDir
+    self.checkpointLocation = os.path.join(cacheDir, 'index.checkpoint')
+    self.generation = 0
+    self.journalFd = None
+    self.readOffset = 0
+    self.partialLine = b''
+    # [fd, offset, partial line] of each journal a predecessor writes
+    self.inherited = []
+    self.loadTime = None
+    self.entries = {}
+    self.shards = set()
+    self.maxBytes = maxBytes
+    self.maxObjects = maxObjects
+    self.policy = policy
+    self.usedBytes = 0
+    # GDSF ages priorities by the last one evicted
+    self.inflation = 0
+
+  # Body files are spread over 256 * 256 directories by a hash of the
+  # key, and every version of a response gets a file of its own
+  def newLocation(self, key):
+    digest = hashlib.sha1(key.encode('latin-1')).hexdigest()
+    shard = os.path.join(self.cacheDir, digest[:2], digest[2:4])
+    if shard not in self.shards:
+      os.makedirs(shard, exist_ok=True)
+      self.shards.add(shard)
+    return os.path.join(shard, digest + '-' + format(time.time_ns(), 'x') + '-' + str(os.getpid()))
+
+  def get(self, key):
+    return self.entries.get(key)
+
+  # Count a use of the stored response for key
+  def touch(self, key):
+    entry = self.entries.get(key)
+    if entry is not None:
+      entry.hits += 1
+      entry.lastAccess = time.time()
+      entry.priority = self.inflation + entry.hits / max(entry.bodySize, 1)
+
+  def rank(self, entry):
+    if self.policy == 'lfu':
+      return (entry.hits, entry.lastAccess)
+    if self.policy == 'gdsf':
+      return (entry.priority, entry.lastAccess)
+    return (entry.lastAccess,)
+
+  def overBudget(self):
+    return self.usedBytes > self.maxBytes or len(self.entries) > self.maxObjects
+
+  # Remove the lowest ranked responses until the cache is back under
+  # CACHE_LOW_WATER of its budgets. The ranking is sorted off the event
+  # loop and the removals are published in batches, yielding in between.
+  async def evict(self):
+    self.catchUp()
+    if not self.overBudget():
+      return
+    ranked = await asyncio.to_thread(sorted, [(self.rank(entry), key) for key, entry in self.entries.items()])
+    targetBytes = self.maxBytes * CACHE_LOW_WATER
+    targetObjects = self.maxObjects * CACHE_LOW_WATER
+    usedBytes = self.usedBytes
+    objects = len(self.entries)
+    records = []
+    for rank, key in ranked:
+      if usedBytes <= targetBytes and objects <= targetObjects:
+        break
+      entry = self.entries.get(key)
+      if entry is None:
+        continue
+      usedBytes -= entry.bodySize
+      objects -= 1
+      metrics.count('cache_evictions')
+      metrics.count('cache_evicted_bytes', entry.bodySize)
+      self.inflation = max(self.inflation, entry.priority)
+      records.append({'key': key, 'removed': True})
+      if len(records) == 64:
+        self.publish(*records)
+        records = []
+        await asyncio.sleep(0)
+    if records:
+      self.publish(*records)
+    log.info('Cache evicted', bytes=usedBytes, objects=objects)
+
+  def journalLocation(self, generation):
+    return os.path.join(self.cacheDir, 'index.' + str(generation))
+
+  def journals(self):
+    generations = []
+    for name in os.listdir(self.cacheDir):
+      match = CACHE_JOURNAL_NAME.fullmatch(name)
+      if match:
+        generations.append(int(match.group(1)))
+    return sorted(generations)
+
+  # Stream in the latest checkpoint and replay the journals written after
+  # it. Runs once before the workers are forked; they then share a new
+  # journal generation, and a checkpoint of what was loaded is written in
+  # the background. With inheriting the journals are kept open to follow
+  # instead, and the checkpoint waits for releaseInherited().
+  def load(self, inheriting=False):
+    self.loadTime = time.time()
+    os.makedirs(self.cacheDir, exist_ok=True)
+    generation, offset = 0, 0
+    try:
+      with open(self.checkpointLocation, 'rb') as checkpoint:
+        header = json.loads(checkpoint.readline())
+        generation, offset = header['generation'], header['offset']
+        for line in checkpoint:
+          self.apply(line)
+    except FileNotFoundError:
+      pass
+    journals = self.journals()
+    for journalGeneration in journals:
+      if journalGeneration >= generation and inheriting:
+        fd = os.open(self.journalLocation(journalGeneration), os.O_RDONLY)
+        self.inherited.append([fd, offset if journalGeneration == generation else 0, b''])
+      elif journalGeneration >= generation:
+        with open(self.journalLocation(journalGeneration), 'rb') as journal:
+          if journalGeneration == generation:
+            journal.seek(offset)
+          for line in journal:
+            self.apply(line)
+    for tail in self.inherited:
+      tail[1], tail[2] = self.follow(*tail)
+    self.generation = max(journals + [generation]) + 1
+    self.journalFd = os.open(self.journalLocation(self.generation), os.O_RDWR | os.O_CREAT | os.O_APPEND, 0o644)
+    log.info('Cache index loaded', objects=len(self.entries), bytes=self.usedBytes)
+    # Files from before this start that nothing refers to are leftovers
+    if not self.inherited:
+      self.checkpoint(self.loadTime)
+
+  # The process this one replaced has exited: take in the last of its
+  # journals, then checkpoint, which deletes them, and sweep the files
+  # from before this start that nothing refers to
+  def releaseInherited(self):
+    self.catchUp()
+    for fd, offset, partialLine in self.inherited:
+      os.close(fd)
+    self.inherited = []
+    self.checkpoint(self.loadTime)
+
+  # Write the index as it is now to a new checkpoint and delete the
+  # journals it covers. This happens in a forked process at low priority,
+  # from a copy of the index that costs nothing to take; the fork is
+  # doubled so that the process never has to be reaped. It waits until
+  # neither writer thread is in the middle of a task, so no lock is held
+  # in the copy. With orphansBefore the process also deletes unreferenced
+  # files older than that.
+  def checkpoint(self, orphansBefore=None):
+    offset = self.readOffset - len(self.partialLine)
+    with log.busy, cacheWriter.busy:
+      pid = os.fork()
+    if pid:
+      os.waitpid(pid, 0)
+      return
+    log.forked()
+    status = 0
+    try:
+      if os.fork() == 0:
+        os.nice(10)
+        self.writeCheckpoint(offset, orphansBefore)
+    except BaseException as err:
+      log.error('Cache checkpoint failed', error=err)
+      status = 1
+    os._exit(status)
+
+  def writeCheckpoint(self, offset, orphansBefore):
+    tempLocation = cacheWriter.tempLocation(self.checkpointLocation)
+    try:
+      with open(tempLocation, 'w', encoding='latin-1') as checkpoint:
+        checkpoint.write(json.dumps({'generation': self.generation, 'offset': offset}) + '\n')
+        for entry in self.entries.values():
+          checkpoint.write(json.dumps(entry.record()) + '\n')
+        checkpoint.flush()
+        cacheWriter.install(checkpoint.fileno(), tempLocation, self.checkpointLocation)
+    except BaseException:
+      cacheWriter.removeFiles(tempLocation)
+      raise
+    for generation in self.journals():
+      if generation < self.generation:
+        os.remove(self.journalLocation(generation))
+    if orphansBefore is not None:
+      self.removeOrphans(orphansBefore)
+
+  # Delete the files in the shard directories that no entry refers to:
+  # temporary files and bodies left behind by a crash
+  def removeOrphans(self, before):
+    referenced = set(entry.location for entry in self.entries.values())
+    for outer in os.scandir(self.cacheDir):
+      if not outer.is_dir() or not CACHE_SHARD_NAME.fullmatch(outer.name):
+        continue
+      for inner in os.scandir(outer.path):
+        if not inner.is_dir() or not CACHE_SHARD_NAME.fullmatch(inner.name):
+          continue
+        for file in os.scandir(inner.path):
+          if file.path not in referenced and file.stat().st_mtime < before:
+            os.remove(file.path)
+
+  # Apply the journal lines appended since we last looked, by any worker
+  # or predecessor
+  def catchUp(self):
+    self.readOffset, self.partialLine = self.follow(self.journalFd, self.readOffset, self.partialLine)
+    for tail in self.inherited:
+      tail[1], tail[2] = self.follow(*tail)
+
+  # Apply the lines of the journal open as fd from offset, the first one
+  # continuing partialLine. Returns where to continue from next time.
+  def follow(self, fd, offset, partialLine):
+    while True:
+      data = os.pread(fd, 65536, offset)
+      if not data:
+        return offset, partialLine
+      offset += len(data)
+      lines = (partialLine + data).split(b'\n')
+      partialLine = lines.pop()
+      for line in lines:
+        self.apply(line)
+
+  def apply(self, line):
+    try:
+      record = json.loads(line)
+      key = record['key']
+      entry = None if record.get('removed') else CacheEntry.fromRecord(record)
+    except (ValueError, KeyError, TypeError):
+      # A line cut short by a crash
+      return
+    current = self.entries.get(key)
+    if current is not None and entry is not None and current.location == entry.location:
+      # A revalidated head for the same body; memory copies share current
+      current.assign(entry)
+      return
+    if entry is None:
+      self.entries.pop(key, None)
+    else:
+      self.entries[key] = entry
+      self.usedBytes += entry.bodySize
+      entry.priority = self.inflation + max(entry.hits, 1) / max(entry.bodySize, 1)
+    if current is not None:
+      # The superseded body goes; while loading there is no writer yet
+      self.usedBytes -= current.bodySize
+      memoryCache.remove(key)
+      if self.journalFd is None:
+        cacheWriter.removeFiles(current.location)
+      else:
+        cacheWriter.submit(cacheWriter.removeFiles, current.location)
 
-  # Extract the method, URI and version of the HTTP client request 
-  requestParts = message.split()
-  method = requestParts[0]
-  URI = requestParts[1]
-  version = requestParts[2]
+  # Record changes to the journal (writer thread)
+  def append(self, *records):
+    os.write(self.journalFd, ''.join(json.dumps(record) + '\n' for record in records).encode('latin-1'))
+    if cacheWriter.fsyncPolicy != 'none':
+      os.fsync(self.journalFd)
 
-  print ('Method:\t\t' + method)
-  print ('URI:\t\t' + URI)
-  print ('Version:\t' + version)
-  print ('')
+  # Record changes after everything already queued on the writer and
+  # apply them here once they are in the journal
+  def publish(self, *records):
+    cacheWriter.submit(self.append, *records)
+    cacheWriter.submit(cacheWriter.callback, self.catchUp)
+
+cacheIndex = CacheIndex(args.cache_dir, args.cache_max_bytes, args.cache_max_objects, args.cache_eviction)
+
+# One response body on its way into the cache. The temporary file is
+# created on the event loop so that followers of a shared fetch can read
+# it straight away; the writes, the rename and the metadata are left to
+# the writer thread. onProgress is called with the length of each chunk
+# once it is in the file.
+class CacheWrite:
+  def __init__(self, cacheLocation, onProgress=None):
+    self.cacheLocation = cacheLocation
+    self.onProgress = onProgress
+    self.tempLocation = cacheWriter.tempLocation(cacheLocation)
+    self.fd = os.open(self.tempLocation, os.O_RDWR | os.O_CREAT | os.O_EXCL, 0o644)
+    self.offset = 0
+    self.pending = 0
+    self.drained = asyncio.Event()
+    self.failed = False
+    self.started = time.monotonic()
+
+  # Queue a chunk of the body. Waits only when the writer has fallen more
+  # than CacheWriter.backlogBytes behind.
+  async def write(self, data):
+    cacheWriter.submit(self.writeChunk, data, self.offset)
+    self.offset += len(data)
+    self.pending += len(data)
+    while self.pending > cacheWriter.backlogBytes:
+      self.drained.clear()
+      await self.drained.wait()
+
+  def writeChunk(self, data, offset):
+    try:
+      if not self.failed:
+        with memoryview(data) as view:
+          while view:
+            written = os.pwrite(self.fd, view, offset)
+            offset += written
+            view = view[written:]
+    except OSError:
+      self.failed = True
+      raise
+    finally:
+      cacheWriter.callback(self.wrote, len(data))
+
+  def wrote(self, length):
+    self.pending -= length
+    self.drained.set()
+    if self.onProgress is not None and not self.failed:
+      self.onProgress(length)
+
+  # A reader of the body written so far, valid after the write finishes
+  def openReader(self):
+    return os.fdopen(os.dup(self.fd), 'rb')
+
+  # Put the body in place and record it in the cache index, then call
+  # onDone on the event loop with whether that worked
+  def commit(self, record, onDone):
+    cacheWriter.submit(self.install, record, onDone)
+
+  def install(self, record, onDone):
+    committed = False
+    try:
+      if not self.failed:
+        cacheWriter.install(self.fd, self.tempLocation, self.cacheLocation)
+        cacheIndex.append(record)
+        committed = True
+    finally:
+      if not committed:
+        cacheWriter.removeFiles(self.tempLocation)
+      cacheWriter.callback(self.finished, onDone, committed)
+
+  # Throw the partial body away
+  def abort(self):
+    cacheWriter.submit(self.discard)
+
+  def discard(self):
+    try:
+      cacheWriter.removeFiles(self.tempLocation)
+    finally:
+      cacheWriter.callback(self.finished, None, False)
+
+  def finished(self, onDone, committed):
+    os.close(self.fd)
+    if committed:
+      metrics.observe('cache_write', time.monotonic() - self.started)
+      cacheIndex.catchUp()
+    if onDone is not None:
+      onDone(committed)
+
+# Whether a response may be stored by a shared cache at all. A 206 only
+# may, and only when it is wanted as a slice (partial).
+def isStorable(request, requestDirectives, framer, partial=False):
+  directives = parseCacheControl(framer.headers.get('cache-control', ''))
+  if 'no-store' in directives or 'private' in directives or 'no-store' in requestDirectives:
+    return False
+  if framer.status < 200 or framer.status == 304 or (framer.status == 206) != partial:
+    return False
+  if '*' in framer.headers.get('vary', ''):
+    return False
+  explicit = 'public' in directives or 's-maxage' in directives
+  if request.header(b'authorization') is not None and not (explicit or 'must-revalidate' in directives):
+    return False
+  return explicit or 'max-age' in directives or 'expires' in framer.headers or framer.status in HEURISTIC_STATUSES
+
+# The request header values a response varies on, recorded with it.
+# Accept-Encoding is left out when the proxy picks the coding itself.
+def varyValues(request, framer):
+  values = {}
+  for name in framer.headers.get('vary', '').split(','):
+    name = name.strip().lower()
+    if name and not (COMPRESSION and name == 'accept-encoding'):
+      values[name] = request.header(name.encode('latin-1'))
+  return values
+
+# The Cache-Control directives of a request, honouring an HTTP/1.0 Pragma
+def requestCacheDirectives(request):
+  cacheControl = request.header(b'cache-control')
+  if cacheControl is None:
+    return {'no-cache': None} if 'no-cache' in request.header(b'pragma', '').lower() else {}
+  return parseCacheControl(cacheControl)
+
+# Find the stored response for a request: from memory when it is hot,
+# otherwise from the cache index and body file. Returns (entry, body)
+# where body is the bytes held in memory or the open cache file, or None.
+def lookupCache(cacheKey, request):
+  cached = findCached(cacheKey)
+  if cached is None:
+    return None
+  if not cached[0].matchesVary(request):
+    closeCached(cached)
+    return None
+  cacheIndex.touch(cacheKey)
+  return cached
+
+def findCached(cacheKey):
+  cached = memoryCache.get(cacheKey)
+  if cached is None:
+    entry, cacheFile = openCached(cacheKey)
+    if cacheFile is None:
+      # Another worker may have stored or replaced it since we last looked
+      cacheIndex.catchUp()
+      entry, cacheFile = openCached(cacheKey)
+      if cacheFile is None:
+        return None
+    if entry.bodySize <= memoryCache.maxObjectBytes and cacheKey not in memoryFills:
+      # Small enough for the memory tier: it is read in there off the
+      # event loop, and served from the file until then
+      memoryFills.add(cacheKey)
+      spawnBackground(fillMemoryCache(entry))
+    cached = (entry, cacheFile)
+  return cached
+
+# Keys whose bodies are being read into the memory tier
+memoryFills = set()
+
+async def fillMemoryCache(entry):
+  try:
+    await readIntoMemory(entry)
+  finally:
+    memoryFills.discard(entry.key)
+
+def openCached(cacheKey):
+  entry = cacheIndex.get(cacheKey)
+  if entry is None:
+    return None, None
+  try:
+    return entry, open(entry.location, 'rb')
+  except OSError:
+    return None, None
+
+def closeCached(cached):
+  if cached is not None and not isinstance(cached[1], bytes):
+    cached[1].close()
+
+# Drop the stored response for a URL from both cache tiers, with its
+# variants in other codings
+def removeCached(cacheKey):
+  for key in [cacheKey] + [variantKey(cacheKey, coding) for coding in CONTENT_CODINGS + ('identity',)]:
+    memoryCache.remove(key)
+    if cacheIndex.get(key) is not None:
+      cacheIndex.publish({'key': key, 'removed': True})
+
+# The content coding of a response, 'identity' when it has none
+def contentCoding(headers):
+  return headers.get('content-encoding', '').strip().lower() or 'identity'
+
+# The codings a client accepts, from its Accept-Encoding, as coding ->
+# qvalue. A client that sends none is given its responses uncompressed.
+def acceptedCodings(request):
+  value = request.header(b'accept-encoding')
+  if value is None:
+    return {'identity': 1.0}
+  accepted = {}
+  for part in value.split(','):
+    coding, sep, parameters = part.partition(';')
+    coding = coding.strip().lower()
+    if not coding:
+      continue
+    quality = 1.0
+    for parameter in parameters.split(';'):
+      name, sep, argument = parameter.strip().partition('=')
+      if name.lower() == 'q':
+        try:
+          quality = float(argument)
+        except ValueError:
+          quality = 0.0
+    accepted[coding] = quality
+  return accepted
+
+def acceptsCoding(accepted, coding):
+  if coding in accepted:
+    return accepted[coding] > 0
+  if '*' in accepted:
+    return accepted['*'] > 0
+  # identity is acceptable unless the client rules it out
+  return coding == 'identity'
+
+# The coding of ours the client likes best, or None when it takes none
+def preferredCoding(accepted):
+  best = None
+  for coding in CONTENT_CODINGS:
+    quality = accepted.get(coding, accepted.get('*', 0))
+    if quality > 0 and (best is None or quality > best[1]):
+      best = (coding, quality)
+  return best[0] if best is not None else None
+
+# Whether an uncompressed body of size bytes is worth compressing
+def isCompressible(headers, size):
+  if contentCoding(headers) != 'identity' or 'content-range' in headers:
+    return False
+  if 'no-transform' in parseCacheControl(headers.get('cache-control', '')):
+    return False
+  if size is not None and size < COMPRESS_MIN_SIZE:
+    return False
+  return COMPRESSIBLE_TYPE.match(headers.get('content-type', '')) is not None
+
+# Whether the proxy offers a response from the origin compressed. A GET
+# answered 200 always has a body, though all of it may already be here.
+def isCompressibleResponse(request, framer):
+  if not COMPRESSION or request.method != 'GET' or framer.status != 200:
+    return False
+  length = framer.headers.get('content-length')
+  return isCompressible(framer.headers, int(length) if length is not None else None)
+
+# The coding to answer request with from a stored entry: its own, or one
+# it can be turned into. None when neither suits the client.
+def storedCoding(request, entry):
+  accepted = acceptedCodings(request)
+  if entry.coding == 'identity':
+    preferred = preferredCoding(accepted) if COMPRESSION else None
+    if preferred is not None and isCompressible(entry.headers, entry.bodySize) and entry.bodySize <= COMPRESS_MAX_SIZE:
+      return preferred
+    return 'identity'
+  if acceptsCoding(accepted, entry.coding):
+    return entry.coding
+  if not COMPRESSION or entry.coding not in CONTENT_CODINGS or entry.bodySize > COMPRESS_MAX_SIZE:
+    return None
+  return preferredCoding(accepted) or ('identity' if acceptsCoding(accepted, 'identity') else None)
+
+# Variants of a stored response in other codings are cached under its
+# key with '#' and the coding appended; a URL has lost any '#' by then.
+# Each records the body file it was made from, so a variant of a
+# response that has since been replaced is never used.
+def variantKey(cacheKey, coding):
+  return cacheKey + '#' + coding
+
+# Header changes that turn the head of a stored response into the head of
+# its variant in coding, with a body of size bytes when that is known
+def variantHeaders(headers, coding, size):
+  vary = headers.get('vary')
+  if vary is None:
+    vary = 'Accept-Encoding'
+  elif 'accept-encoding' not in vary.lower():
+    vary += ', Accept-Encoding'
+  updates = {'content-encoding': None if coding == 'identity' else coding,
+             'content-length': str(size) if size is not None else None, 'vary': vary}
+  # The variant is a different representation, so it cannot share a
+  # strong validator with the original
+  etag = headers.get('etag')
+  if etag is not None and not etag.startswith('W/'):
+    updates['etag'] = 'W/' + etag
+  return updates
+
+def lookupVariant(cacheKey, entry, coding):
+  key = variantKey(cacheKey, coding)
+  cached = findCached(key)
+  if cached is None:
+    return None
+  if cached[0].source != entry.location:
+    closeCached(cached)
+    return None
+  cacheIndex.touch(key)
+  return cached
+
+# Variants being made, by key
+variantJobs = {}
+
+# Make the variant of a stored response in coding, once however many
+# requests want it at the same time. Returns (entry, body) or None.
+async def makeVariant(cacheKey, entry, body, coding):
+  key = variantKey(cacheKey, coding)
+  job = variantJobs.get(key)
+  if job is None:
+    # The job reads its own copy of the body; body is closed with the request
+    source = body if isinstance(body, bytes) else entry.location
+    job = asyncio.ensure_future(buildVariant(key, entry, source, coding))
+    variantJobs[key] = job
+    job.add_done_callback(lambda done: variantJobs.pop(key, None))
+  return await asyncio.shield(job)
+
+async def buildVariant(key, entry, source, coding):
+  try:
+    data = await asyncio.to_thread(transcodeBody, source, entry.coding, coding)
+  except Exception as err:
+    log.warning('Failed to transcode cached response', key=key, error=err)
+    return None
+  variant = CacheEntry(key, cacheIndex.newLocation(key), entry.head, entry.requestTime,
+                       entry.responseTime, entry.varyValues)
+  variant.source = entry.location
+  variant.bodySize = len(data)
+  try:
+    cacheWrite = CacheWrite(variant.location)
+  except OSError as err:
+    log.error('Failed to create cache file', key=key, error=err)
+    return variant, data
+  await cacheWrite.write(data)
+  cacheWrite.commit(variant.record(), None)
+  log.debug('Cached variant', key=key, bytes=len(data))
+  return variant, data
+
+# Turn a whole body from one coding into another, off the event loop.
+# source is the body or the file holding it.
+def transcodeBody(source, sourceCoding, coding):
+  transcoder = Transcoder(sourceCoding, coding)
+  parts = []
+  size = 0
+  def add(data):
+    nonlocal size
+    size += len(data)
+    if size > COMPRESS_MAX_SIZE:
+      raise ValueError('transcoded body too large')
+    parts.append(data)
+  if isinstance(source, bytes):
+    add(transcoder.feed(source))
+  else:
+    with open(source, 'rb') as file:
+      while True:
+        data = file.read(SENDFILE_SEGMENT)
+        if not data:
+          break
+        add(transcoder.feed(data))
+  add(transcoder.finish())
+  return b''.join(parts)
+
+# Streams a body from one content coding into another, either of which
+# may be identity
+class Transcoder:
+  def __init__(self, sourceCoding, coding):
+    self.decode = self.finishDecode = self.encode = self.finishEncode = None
+    if sourceCoding == 'br':
+      decoder = brotli.Decompressor()
+      self.decode = decoder.process
+      self.finishDecode = lambda: b''
+    elif sourceCoding == 'gzip':
+      decoder = zlib.decompressobj(zlib.MAX_WBITS | 16)
+      self.decode = decoder.decompress
+      self.finishDecode = decoder.flush
+    if coding == 'br':
+      encoder = brotli.Compressor(quality=COMPRESS_LEVEL)
+      self.encode = encoder.process
+      self.finishEncode = encoder.finish
+    elif coding == 'gzip':
+      encoder = zlib.compressobj(COMPRESS_LEVEL, zlib.DEFLATED, zlib.MAX_WBITS | 16)
+      self.encode = encoder.compress
+      self.finishEncode = encoder.flush
+
+  def feed(self, data):
+    if self.decode is not None:
+      data = self.decode(data)
+    if self.encode is not None:
+      data = self.encode(data)
+    return data
+
+  def finish(self):
+    data = self.finishDecode() if self.decode is not None else b''
+    if self.encode is not None:
+      data = self.encode(data) + self.finishEncode()
+    return data
+
+# The single span of bytes a request asks for, as (first, last) with last
+# None for the rest of the body, or (None, length) for its final length
+# bytes. None when there is no Range or not one this proxy serves: other
+# units and several ranges get the whole body, as RFC 9110 allows.
+def requestedRange(request):
+  value = request.header(b'range')
+  match = RANGE_SPEC.fullmatch(value) if value is not None else None
+  if match is None or not (match.group(1) or match.group(2)):
+    return None
+  first = int(match.group(1)) if match.group(1) else None
+  last = int(match.group(2)) if match.group(2) else None
+  if first is not None and last is not None and last < first:
+    return None
+  return first, last
+
+# The bytes (first, last) a requested range covers of a body of size
+# bytes, or None when it covers none of them
+def resolveRange(byteRange, size):
+  first, last = byteRange
+  if first is None:
+    first = max(size - last, 0)
+    last = size - 1
+  elif last is None or last >= size:
+    last = size - 1
+  if first >= size or last < first:
+    return None
+  return first, last
+
+# Whether a range applies to the stored version with these validators:
+# an If-Range has to name it by strong ETag or by its exact date
+def rangeApplies(request, etag, lastModified):
+  value = request.header(b'if-range')
+  if value is None:
+    return True
+  if value.startswith('"'):
+    return value == etag
+  return not value.startswith('W/') and value == lastModified
+
+# A Content-Range value as (first, last, total), first and last None for
+# an unsatisfied range and total None when unknown, or None
+def parseContentRange(value):
+  match = CONTENT_RANGE.fullmatch(value)
+  if match is None:
+    return None
+  first, last, total = match.groups()
+  return (int(first) if first else None, int(last) if last else None,
+          int(total) if total != '*' else None)
+
+# The key slice index of a large object is cached under
+def sliceKey(cacheKey, index):
+  return cacheKey + '#slice' + str(index)
+
+# Slices being fetched, by key
+sliceFetches = {}
+
+# Slice index of the object at cacheKey: as stored while it is fresh,
+# otherwise fetched from the origin once however many requests want it
+# at the same time. Returns (entry, body, fetched) or None when the
+# origin did not answer with the slice.
+async def getSlice(clientSocket, request, hostname, resource, cacheKey, index):
+  key = sliceKey(cacheKey, index)
+  cached = findCached(key)
+  if cached is not None:
+    if cached[0].isFresh(requestCacheDirectives(request), time.time()) and cached[0].matchesVary(request):
+      cacheIndex.touch(key)
+      return cached + (False,)
+    closeCached(cached)
+  fetch = sliceFetches.get(key)
+  if fetch is None:
+    fetch = asyncio.ensure_future(fetchSlice(clientSocket, request, hostname, resource, key, index))
+    sliceFetches[key] = fetch
+    fetch.add_done_callback(lambda done: sliceFetches.pop(key, None))
+  fetched = await asyncio.shield(fetch)
+  return fetched + (True,) if fetched is not None else None
+
+# What tells versions of a sliced object apart
+def sliceVersion(entry):
+  contentRange = parseContentRange(entry.headers.get('content-range', ''))
+  return entry.headers.get('etag'), entry.headers.get('last-modified'), contentRange and contentRange[2]
+
+# A cacheable miss being fetched from the origin, which later requests
+# for the same URL join instead of fetching it again (collapsed
+# forwarding). The fetching request writes the body into the cache; the
+# others send it to their clients from the file as it grows.
+class SharedFetch:
+  def __init__(self, cacheKey):
+    # pending -> streaming -> committing -> done, or refreshed, declined
+    # or failed
+    self.state = 'pending'
+    self.cacheKey = cacheKey
+    self.entry = None
+    self.cacheWrite = None
+    self.chunked = False
+    self.written = 0
+    self.event = asyncio.Event()
+
+  def notify(self):
+    self.event.set()
+    self.event = asyncio.Event()
+
+  async def changed(self):
+    await self.event.wait()
+
+  # The response is being stored; followers can start streaming it. A
+  # chunked response is stored de-chunked, with its length unknown until
+  # it is complete.
+  def stream(self, entry, cacheWrite, chunked):
+    self.state = 'streaming'
+    self.entry = entry
+    self.cacheWrite = cacheWrite
+    self.chunked = chunked
+    self.notify()
+
+  def advance(self, length):
+    self.written += length
+    self.notify()
+
+  # The whole body is relayed; it is in the cache once the writer has
+  # renamed it into place
+  def committing(self):
+    self.state = 'committing'
+
+  def complete(self):
+    self.state = 'done'
+    self.notify()
+    self.unregister()
+
+  def fail(self):
+    self.state = 'failed'
+    self.notify()
+    self.unregister()
+
+  # A 304 made the stored response fresh again
+  def refreshed(self, entry):
+    self.state = 'refreshed'
+    self.entry = entry
+    self.notify()
+
+  # The response may not be stored, so it cannot be shared either
+  def decline(self):
+    self.state = 'declined'
+    self.notify()
+
+  # Called once the fetching request is over, however it ended. A body
+  # still being committed keeps the fetch open for new followers.
+  def finish(self):
+    if self.state in ('pending', 'streaming'):
+      self.fail()
+    elif self.state != 'committing':
+      self.unregister()
+
+  def unregister(self):
+    if sharedFetches.get(self.cacheKey) is self:
+      del sharedFetches[self.cacheKey]
+
+  # Answer another request from this fetch. cached is what that request
+  # found in the cache, if anything. Returns whether the client connection
+  # can carry another request, or None when this fetch cannot answer it
+  # and nothing has been sent.
+  async def follow(self, clientSocket, request, cached):
+    loop = asyncio.get_running_loop()
+    while self.state == 'pending':
+      await self.changed()
+    if self.state == 'refreshed' and cached is not None:
+      return await serveStored(clientSocket, request, self.cacheKey, self.entry, cached[1])
+    if self.state not in ('streaming', 'committing', 'done') or not self.entry.matchesVary(request):
+      return None
+    if not acceptsCoding(acceptedCodings(request), self.entry.coding):
+      return None
+    try:
+      if self.state != 'done':
+        cacheFile = self.cacheWrite.openReader()
+      else:
+        cacheFile = open(self.cacheWrite.cacheLocation, 'rb')
+    except OSError:
+      return None
+
+    # Joining a chunked response before its length is known, the body is
+    # chunked again as it grows, or for HTTP/1.0 ended by closing
+    chunked = self.chunked and self.state == 'streaming'
+    updates = {}
+    if chunked:
+      if request.version == 'HTTP/1.0':
+        updates['connection'] = 'close'
+        chunked = False
+        delimited = False
+      else:
+        updates['transfer-encoding'] = 'chunked'
+        delimited = True
+    else:
+      delimited = self.entry.selfDelimiting
+
+    request.responseStatus = self.entry.status
+    with cacheFile:
+      await sendToClient(clientSocket, self.entry.responseHead(time.time(), updates))
+      sent = 0
+      while True:
+        if sent < self.written:
+          count = self.written - sent
+          if chunked:
+            await sendToClient(clientSocket, format(count, 'x').encode() + b'\r\n')
+          sent += await sendFileToClient(clientSocket, cacheFile, sent, count)
+          request.responseBytes = sent
+          metrics.count('bytes_from_cache', count)
+          if chunked:
+            await sendToClient(clientSocket, b'\r\n')
+        elif self.state == 'done':
+          if chunked:
+            await sendToClient(clientSocket, b'0\r\n\r\n')
+          return delimited
+        elif self.state == 'failed':
+          raise ConnectionError('shared origin fetch failed mid-response')
+        else:
+          await self.changed()
+
+# In-flight cacheable fetches by cache key
+sharedFetches = {}
+
+# The cache key of a resource. Host names are case-insensitive and the
+# default port is the same as none.
+def cacheKeyFor(hostname, resource):
+  return re.sub(':80$', '', hostname.lower()) + resource
+
+# Stands in for the client request when the proxy fetches on its own,
+# with copies of the headers of the request that led to the fetch
+class BackgroundRequest:
+  method = 'GET'
+  version = 'HTTP/1.1'
+  hasBody = False
+
+  def __init__(self, headers):
+    self.headers = headers
+
+  def header(self, name, default=None):
+    return self.headers.get(name, default)
+
+  def fieldLines(self):
+    return [(name, name + b': ' + value.encode('latin-1')) for name, value in self.headers.items()]
+
+# The headers of request a BackgroundRequest made on its behalf copies
+def backgroundHeaders(request):
+  headers = {}
+  for name in BACKGROUND_HEADERS:
+    value = request.header(name)
+    if value is not None:
+      headers[name] = value
+  return headers
+
+# Tasks the proxy runs on its own, referenced until they finish
+backgroundTasks = set()
+
+def spawnBackground(coroutine):
+  task = asyncio.ensure_future(coroutine)
+  backgroundTasks.add(task)
+  task.add_done_callback(backgroundTasks.discard)
+
+# Bring a stale entry that was served as it is up to date, unless a
+# fetch of the same URL is already doing that
+async def revalidateInBackground(hostname, resource, cacheKey, entry, headers):
+  if cacheKey in sharedFetches:
+    return
+  try:
+    await fetchInBackground(hostname, resource, cacheKey, BackgroundRequest(headers), entry)
+  except (OSError, ValueError, RequestTimeout, Overloaded) as err:
+    log.debug('Background revalidation failed', key=cacheKey, error=err)
+
+# Warms the cache with the stylesheets, scripts and images a freshly
+# cached HTML page links to on its own origin, so that the requests the
+# browser sends for them once it has the page are hits. Pages are
+# scanned off the event loop and at most concurrency prefetches run at
+# once; each is a shared fetch a browser request arriving meanwhile joins.
+class Prefetcher:
+  def __init__(self, concurrency, maxLinks):
+    self.semaphore = asyncio.Semaphore(max(concurrency, 1))
+    self.maxLinks = maxLinks
+    self.queued = set()
+
+  # A page was stored under entry, its body held in memory or None
+  def pageCached(self, hostname, resource, entry, body, headers):
+    spawnBackground(self.scanPage(hostname, resource, entry, body, headers))
+
+  async def scanPage(self, hostname, resource, entry, body, headers):
+    try:
+      links = await asyncio.to_thread(findLinks, body if body is not None else entry.location, entry.coding)
+    except Exception as err:
+      log.debug('Failed to scan page for links', key=entry.key, error=err)
+      return
+    pageHost = cacheKeyFor(hostname, '')
+    taken = 0
+    for link in links:
+      parts = urllib.parse.urlsplit(urllib.parse.urljoin('http://' + hostname + resource, link))
+      if parts.scheme != 'http' or cacheKeyFor(parts.netloc, '') != pageHost:
+        continue
+      linkResource = (parts.path or '/') + ('?' + parts.query if parts.query else '')
+      cacheKey = cacheKeyFor(hostname, linkResource)
+      if cacheKey in self.queued or cacheKey in sharedFetches or cacheIndex.get(cacheKey) is not None:
+        continue
+      if taken == self.maxLinks or len(self.queued) >= PREFETCH_QUEUE_MAX:
+        break
+      taken += 1
+      self.queued.add(cacheKey)
+      spawnBackground(self.prefetch(hostname, linkResource, cacheKey, headers))
+    if taken:
+      log.debug('Prefetching linked resources', key=entry.key, links=taken)
+
+  async def prefetch(self, hostname, resource, cacheKey, headers):
+    try:
+      async with self.semaphore:
+        # The browser may have asked for it while this waited its turn
+        if cacheKey in sharedFetches or cacheIndex.get(cacheKey) is not None:
+          return
+        metrics.count('prefetches')
+        await fetchInBackground(hostname, resource, cacheKey, BackgroundRequest(headers))
+    except (OSError, ValueError, RequestTimeout, Overloaded) as err:
+      log.debug('Prefetch failed', key=cacheKey, error=err)
+    finally:
+      self.queued.discard(cacheKey)
+
+prefetcher = Prefetcher(args.prefetch_concurrency, args.prefetch_links) if args.prefetch else None
+
+# The URLs of the stylesheets, scripts and images an HTML page links to,
+# from its first PREFETCH_SCAN_BYTES, off the event loop. source is the
+# body or the file holding it.
+def findLinks(source, coding):
+  if coding != 'identity' and coding not in CONTENT_CODINGS:
+    return []
+  transcoder = Transcoder(coding, 'identity')
+  parts = []
+  scanned = 0
+  file = open(source, 'rb') if isinstance(source, str) else None
+  try:
+    position = 0
+    while scanned < PREFETCH_SCAN_BYTES:
+      if file is not None:
+        data = file.read(SENDFILE_SEGMENT)
+      else:
+        data = source[position:position + SENDFILE_SEGMENT]
+        position += len(data)
+      if not data:
+        break
+      data = transcoder.feed(data)
+      parts.append(data)
+      scanned += len(data)
+  finally:
+    if file is not None:
+      file.close()
+  # Inline scripts and comments only look like markup
+  page = HTML_OPAQUE.sub(lambda match: match.group(1) or '', b''.join(parts)[:PREFETCH_SCAN_BYTES].decode('latin-1'))
+
+  links = []
+  for tag in PREFETCH_TAG.finditer(page):
+    attributes = {}
+    for attribute in HTML_ATTRIBUTE.finditer(tag.group(2)):
+      attributes.setdefault(attribute.group(1).lower(), next(value for value in attribute.groups()[1:] if value is not None))
+    if tag.group(1).lower() == 'link':
+      if not set(attributes.get('rel', '').lower().split()) & set(PREFETCH_RELATIONS):
+        continue
+      link = attributes.get('href')
+    else:
+      link = attributes.get('src')
+    if link:
+      links.append(html.unescape(link.strip()))
+  return links
+
+# Answer one request from the cache or the origin server. Returns whether
+# the client connection can be kept open for the next request.
+async def handleRequest(clientSocket, clientAddress, request):
+  # Extract the method, URI and version of the HTTP client request
+  method = request.method
+  URI = request.uri
+  version = request.version
+
+  log.debug('Request', method=method, uri=URI, version=version)
+
+  # HTTP/1.1 connections persist unless the client asks to close them,
+  # HTTP/1.0 ones only when the client asks to keep them
+  connectionHeader = request.header(b'connection', '').lower()
+  if version == 'HTTP/1.0':
+    keepAlive = 'keep-alive' in connectionHeader
+  else:
+    keepAlive = 'close' not in connectionHeader
+
+  # The proxy's own metrics, asked for by path rather than by URL
+  if URI.split('?', 1)[0] == STATS_PATH:
+    request.cacheStatus = 'STATS'
+    result = await serveStats(clientSocket, request)
+    return keepAlive and result
+  metrics.count('requests')
+
+  if method == 'CONNECT':
+    return await openTunnel(clientSocket, request)
+
+  # The origin is only spoken to in plain HTTP; HTTPS goes through CONNECT
+  if re.match('^/?https://', URI):
+    request.responseStatus = 501
+    await sendToClient(clientSocket, NOT_IMPLEMENTED_RESPONSE)
+    return keepAlive
 
   # Get the requested resource from URI
   # Remove http protocol from the URI
@@ -89,6 +2967,9 @@ while True:
   # Remove parent directory changes - security
   URI = URI.replace('/..', '')
 
+  # A fragment is never part of the resource
+  URI = URI.split('#', 1)[0]
+
   # Split hostname from resource name
   resourceParts = URI.split('/', 1)
   hostname = resourceParts[0]
@@ -98,117 +2979,1380 @@ while True:
     # Resource is absolute URI with hostname and resource
     resource = resource + resourceParts[1]
 
-  print ('Requested Resource:\t' + resource)
+  try:
+    splitHostPort(hostname, 80)
+  except ValueError:
+    log.warning('Bad host in request', client=clientAddress[0], host=hostname)
+    metrics.count('bad_requests')
+    request.responseStatus = 400
+    await sendToClient(clientSocket, BAD_REQUEST_RESPONSE)
+    return False
 
   # Check if resource is in cache
+  cacheKey = cacheKeyFor(hostname, resource)
+  log.debug('Cache lookup', key=cacheKey)
+
+  # Only GET responses are cached, so everything else goes to the origin
+  if method != 'GET':
+    request.cacheStatus = 'BYPASS'
+    reusable = await fetchFromOrigin(clientSocket, request, hostname, resource, None)
+    return keepAlive and reusable
+
+  # A fresh stored response is served as it is. A stale one is served as
+  # it is too while stale-while-revalidate allows, and brought up to date
+  # in the background; otherwise it is revalidated with a conditional
+  # request when it carries validators, and kept to stand in for an
+  # origin that fails while stale-if-error allows.
+  requestDirectives = requestCacheDirectives(request)
+  cached = lookupCache(cacheKey, request)
   try:
-    cacheLocation = './' + hostname + resource
-    if cacheLocation.endswith('/'):
-        cacheLocation = cacheLocation + 'default'
+    staleCached = None
+    if cached is not None:
+      entry, body = cached
+      now = time.time()
+      if entry.isFresh(requestDirectives, now):
+        request.cacheStatus = 'HIT'
+        result = await serveStored(clientSocket, request, cacheKey, entry, body)
+        if result is not None:
+          log.debug('Cache hit', key=cacheKey)
+          metrics.count('cache_hits')
+          return keepAlive and result
+        # Stored in a coding this client cannot take: fetch it for them
+        log.debug('Cached coding not acceptable', key=cacheKey)
+      elif storedCoding(request, entry) is not None:
+        if (request.header(b'authorization') is None and
+            entry.mayServeStale(requestDirectives, now, 'stale-while-revalidate', STALE_WHILE_REVALIDATE)):
+          headers = backgroundHeaders(request)
+          request.cacheStatus = 'STALE'
+          result = await serveStored(clientSocket, request, cacheKey, entry, body)
+          if result is not None:
+            log.debug('Serving stale entry while revalidating it', key=cacheKey)
+            metrics.count('cache_hits')
+            metrics.count('stale_served')
+            spawnBackground(revalidateInBackground(hostname, resource, cacheKey, entry, headers))
+            return keepAlive and result
+        log.debug('Cache entry is stale', key=cacheKey)
+        staleCached = cached
 
-    print ('Cache location:\t\t' + cacheLocation)
+    # A range of an object that is not stored whole is served from slices
+    # of it rather than by fetching all of it
+    byteRange = requestedRange(request) if SLICE_SIZE and cached is None and not request.hasBody else None
+    if byteRange is not None:
+      result = await serveSlices(clientSocket, request, hostname, resource, cacheKey, byteRange)
+      if result is not None:
+        return keepAlive and result
 
-    fileExists = os.path.isfile(cacheLocation)
-    
-    # Check wether the file is currently in the cache
-    cacheFile = open(cacheLocation, "r")
-    cacheData = cacheFile.readlines()
+    # Only one request per URL goes to the origin at a time; the others
+    # are answered from its response
+    sharedFetch = sharedFetches.get(cacheKey)
+    if sharedFetch is not None:
+      log.debug('Joining in-flight fetch', key=cacheKey)
+      result = await sharedFetch.follow(clientSocket, request, cached)
+      if result is not None:
+        metrics.count('collapsed')
+        request.cacheStatus = 'COLLAPSED'
+        return keepAlive and result
+      metrics.count('cache_misses')
+      request.cacheStatus = 'MISS'
+      reusable = await fetchFromOrigin(clientSocket, request, hostname, resource, cacheKey, staleCached)
+      return keepAlive and reusable
 
-    print ('Cache hit! Loading from cache file: ' + cacheLocation)
-    # ProxyServer finds a cache hit
-    # Send back response to client 
-    # ~~~~ INSERT CODE ~~~~
-    response = ''.join(cacheData)
-    clientSocket.sendall(response.encode())
-    # ~~~~ END CODE INSERT ~~~~
-    cacheFile.close()
-    print ('Sent to the client:')
-    print ('> ' + cacheData)
-  except:
-    # cache miss.  Get resource from origin server
-    originServerSocket = None
-    # Create a socket to connect to origin server
-    # and store in originServerSocket
-    # ~~~~ INSERT CODE ~~~~
-    originServerSocket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-    # ~~~~ END CODE INSERT ~~~~
+    metrics.count('cache_misses')
+    request.cacheStatus = 'MISS'
+    sharedFetch = SharedFetch(cacheKey)
+    sharedFetches[cacheKey] = sharedFetch
+    try:
+      reusable = await fetchFromOrigin(clientSocket, request, hostname, resource, cacheKey, staleCached, sharedFetch)
+    finally:
+      sharedFetch.finish()
+    return keepAlive and reusable
+  finally:
+    closeCached(cached)
 
-    print ('Connecting to:\t\t' + hostname + '\n')
+# Answer a CONNECT request with a tunnel to the host and port it names.
+# Once the origin connection is up the client is told so and from then on
+# bytes are relayed both ways untouched, each direction as its own task on
+# the event loop, until both sides have finished sending. The client
+# connection ends with the tunnel.
+async def openTunnel(clientSocket, request):
+  loop = asyncio.get_running_loop()
+  request.cacheStatus = 'TUNNEL'
+  try:
+    host, port = splitHostPort(request.uri, 443)
+  except ValueError:
+    metrics.count('bad_requests')
+    request.responseStatus = 400
+    await sendToClient(clientSocket, BAD_REQUEST_RESPONSE)
+    return False
+  # Tunnels to any port would make the proxy an open relay
+  if port not in CONNECT_PORTS:
+    log.warning('Tunnel to port not allowed', host=host, port=port)
+    request.responseStatus = 403
+    await sendToClient(clientSocket, FORBIDDEN_RESPONSE)
+    return False
+
+  origin = host.lower() + ':' + str(port)
+  await admitToOrigin(origin)
+  try:
     try:
-      # Get the IP address for a hostname
-      address = socket.gethostbyname(hostname)
-      # Connect to the origin server
-      # ~~~~ INSERT CODE ~~~~
-      originServerSocket.connect((address, 80))
-      # ~~~~ END CODE INSERT ~~~~
-      print ('Connected to origin Server')
-
-      originServerRequest = ''
-      originServerRequestHeader = ''
-      # Create origin server request line and headers to send
-      # and store in originServerRequestHeader and originServerRequest
-      # originServerRequest is the first line in the request and
-      # originServerRequestHeader is the second line in the request
-      # ~~~~ INSERT CODE ~~~~
-      originServerRequest = f"{method} {resource} {version}"
-      originServerRequestHeader = f"Host: {hostname}\r\nConnection: close"
-      # ~~~~ END CODE INSERT ~~~~
+      with Timeout('connect', ORIGIN_CONNECT_TIMEOUT):
+        originServerSocket = await connectToOrigin(host, port)
+    except OSError as err:
+      log.warning('Tunnel connection failed', host=host, port=port, error=err.strerror or err)
+      metrics.count('origin_errors')
+      request.responseStatus = 502
+      await sendToClient(clientSocket, BAD_GATEWAY_RESPONSE)
+      return False
+    log.debug('Tunnel open', host=host, port=port)
+    metrics.count('tunnels')
+    request.responseStatus = 200
 
-      # Construct the request to send to the origin server
-      request = originServerRequest + '\r\n' + originServerRequestHeader + '\r\n\r\n'
+    relays = ()
+    try:
+      await sendToClient(clientSocket, b'HTTP/1.1 200 Connection Established\r\n\r\n')
+      # The tunnel is closed once no bytes have moved either way for
+      # TUNNEL_IDLE_TIMEOUT seconds
+      with Timeout('tunnel', TUNNEL_IDLE_TIMEOUT) as idle:
+        # Whatever the client sent right after the head, such as a TLS
+        # ClientHello, is the start of the tunnelled stream
+        early = request.takeBuffered()
+        if early:
+          await loop.sock_sendall(originServerSocket, early)
+          metrics.count('bytes_tunneled', len(early))
+        relays = (asyncio.ensure_future(relayTunnel(clientSocket, originServerSocket, idle)),
+                  asyncio.ensure_future(relayTunnel(originServerSocket, clientSocket, idle, request)))
+        # One direction failing means the connection as a whole is gone
+        done, running = await asyncio.wait(relays, return_when=asyncio.FIRST_EXCEPTION)
+        for relay in done:
+          if relay.exception() is not None:
+            log.debug('Tunnel closed', host=host, port=port, error=relay.exception())
+    except OSError as err:
+      log.debug('Tunnel closed', host=host, port=port, error=err.strerror or err)
+    finally:
+      # The relays stop watching the sockets before they are closed
+      for relay in relays:
+        relay.cancel()
+      if relays:
+        await asyncio.wait(relays)
+      originServerSocket.close()
+    return False
+  finally:
+    leaveOrigin(origin)
 
-      # Request the web resource from origin server
-      print ('Forwarding request to origin server:')
-      for line in request.split('\r\n'):
-        print ('> ' + line)
+# Relay everything source sends to destination, then pass the end of the
+# stream on. Where the platform has splice the bytes move from socket to
+# pipe to socket inside the kernel and are never copied into the process;
+# elsewhere they go through a pooled buffer. Every move restarts the
+# idle timeout, and bytes sent to the client are counted in request.
+async def relayTunnel(source, destination, idle, request=None):
+  if hasattr(os, 'splice'):
+    await spliceTunnel(source, destination, idle, request)
+  else:
+    await copyTunnel(source, destination, idle, request)
+  try:
+    destination.shutdown(socket.SHUT_WR)
+  except OSError:
+    pass
 
+async def spliceTunnel(source, destination, idle, request):
+  pipeOut, pipeIn = os.pipe()
+  flags = os.SPLICE_F_MOVE | os.SPLICE_F_NONBLOCK
+  try:
+    while True:
       try:
-        originServerSocket.sendall(request.encode())
-      except socket.error:
-        print ('Forward request to origin failed')
-        sys.exit()
+        received = os.splice(source.fileno(), pipeIn, RELAY_BUFFER_SIZE, flags=flags)
+      except BlockingIOError:
+        await socketReady(source, False)
+        continue
+      if not received:
+        return
+      # The pipe is drained completely before the next read fills it
+      pending = received
+      while pending:
+        try:
+          pending -= os.splice(pipeOut, destination.fileno(), pending, flags=flags)
+        except BlockingIOError:
+          await socketReady(destination, True)
+      countTunnelled(received, idle, request)
+  finally:
+    os.close(pipeIn)
+    os.close(pipeOut)
+
+async def copyTunnel(source, destination, idle, request):
+  loop = asyncio.get_running_loop()
+  relayBuffer = bufferPool.acquire(RELAY_BUFFER_SIZE)
+  try:
+    while True:
+      received = await loop.sock_recv_into(source, relayBuffer)
+      if not received:
+        return
+      with memoryview(relayBuffer)[:received] as data:
+        await loop.sock_sendall(destination, data)
+      countTunnelled(received, idle, request)
+  finally:
+    bufferPool.release(relayBuffer)
+
+def countTunnelled(count, idle, request):
+  idle.restart()
+  metrics.count('bytes_tunneled', count)
+  if request is not None:
+    request.responseBytes += count
+
+# Wait until sock can be read from, or written to when writing
+async def socketReady(sock, writing):
+  loop = asyncio.get_running_loop()
+  ready = loop.create_future()
+  def wake():
+    if not ready.done():
+      ready.set_result(None)
+  fd = sock.fileno()
+  if writing:
+    loop.add_writer(fd, wake)
+  else:
+    loop.add_reader(fd, wake)
+  try:
+    await ready
+  finally:
+    if writing:
+      loop.remove_writer(fd)
+    else:
+      loop.remove_reader(fd)
+
+# Answer request with a stored response in a coding the client accepts:
+# as it is stored, or as its variant in another coding, made now if need
+# be. Returns whether the client connection can carry another request,
+# or None when the response cannot be had in a coding the client takes
+# and nothing has been sent.
+async def serveStored(clientSocket, request, cacheKey, entry, body):
+  coding = storedCoding(request, entry)
+  if coding is None:
+    return None
+  if coding != entry.coding:
+    variant = lookupVariant(cacheKey, entry, coding)
+    if variant is None:
+      variant = await makeVariant(cacheKey, entry, body, coding)
+    if variant is not None:
+      try:
+        updates = variantHeaders(entry.headers, coding, variant[0].bodySize)
+        return await serveCached(clientSocket, request, entry, variant[1], updates, variant[0].bodySize)
+      finally:
+        closeCached(variant)
+    if not acceptsCoding(acceptedCodings(request), entry.coding):
+      return None
+  updates = {}
+  if COMPRESSION and (entry.coding != 'identity' or isCompressible(entry.headers, entry.bodySize)):
+    # Other clients get other codings of it
+    updates = variantHeaders(entry.headers, entry.coding, entry.bodySize)
+    updates.pop('etag', None)
+  return await serveCached(clientSocket, request, entry, body, updates)
+
+# Send a stored response to request: its head with the current Age and
+# any updates, then the body from memory or from the cache file, of
+# bodySize bytes when it is not the entry's own. A request for one range
+# of a whole 200 gets a 206 of just those bytes, unless its If-Range
+# names another version. Returns whether the response marks its own end
+# so the client connection can carry another request.
+async def serveCached(clientSocket, request, entry, body, updates={}, bodySize=None):
+  if bodySize is None:
+    bodySize = entry.bodySize
+  offset = 0
+  count = bodySize
+  head = None
+  if entry.status == 200:
+    updates = dict(updates, **{'accept-ranges': 'bytes'})
+    byteRange = requestedRange(request)
+    if byteRange is not None and rangeApplies(request, updates.get('etag', entry.headers.get('etag')),
+                                              entry.headers.get('last-modified')):
+      span = resolveRange(byteRange, bodySize)
+      if span is None:
+        return await sendRangeNotSatisfiable(clientSocket, request, bodySize)
+      offset, last = span
+      count = last - offset + 1
+      updates['content-range'] = 'bytes ' + str(offset) + '-' + str(last) + '/' + str(bodySize)
+      updates['content-length'] = str(count)
+      head = entry.responseHead(time.time(), updates)
+      head = b'HTTP/1.1 206 Partial Content' + head[head.index(b'\r\n'):]
+  if head is None and not entry.selfDelimiting:
+    # The body ends where the connection does
+    updates = dict(updates, connection='close')
+  # ProxyServer finds a cache hit
+  # Send back response to client
+  # ~~~~ INSERT CODE ~~~~
+  await sendToClient(clientSocket, head or entry.responseHead(time.time(), updates))
+  if isinstance(body, bytes):
+    with memoryview(body) as view:
+      await sendToClient(clientSocket, view[offset:offset + count])
+  else:
+    # The bytes go from the page cache straight to the socket with
+    # sendfile, so a hit is never copied through user space
+    await sendFileToClient(clientSocket, body, offset, count)
+  # ~~~~ END CODE INSERT ~~~~
+  metrics.count('bytes_from_cache', count)
+  request.responseStatus = 206 if head is not None else entry.status
+  request.responseBytes = count
+  return head is not None or entry.selfDelimiting
+
+# Answer a range request for a large object not stored whole from
+# slices of SLICE_SIZE bytes, each cached on its own, so that seeking
+# through the object fills the cache a slice at a time. Missing and
+# stale slices are fetched from the origin as ranges of their own.
+# A suffix range starts from the first slice, which tells the length it
+# is resolved against. Returns None, with nothing sent, when the origin
+# does not serve the object in slices and it is better fetched whole.
+async def serveSlices(clientSocket, request, hostname, resource, cacheKey, byteRange):
+  first, last = byteRange
+  index = first // SLICE_SIZE if first is not None else 0
+  current = await getSlice(clientSocket, request, hostname, resource, cacheKey, index)
+  if current is None:
+    return None
+  try:
+    entry, body, fetched = current
+    total = sliceVersion(entry)[2]
+    if total is None:
+      return None
+    span = resolveRange(byteRange, total) if entry.status != 416 else None
+    if span is None:
+      request.cacheStatus = 'MISS' if fetched else 'HIT'
+      return await sendRangeNotSatisfiable(clientSocket, request, total)
+    if not rangeApplies(request, entry.headers.get('etag'), entry.headers.get('last-modified')):
+      return None
+    first, last = span
+    if first // SLICE_SIZE != index:
+      # The suffix starts in a later slice, of the same version
+      probed = sliceVersion(entry)
+      closeCached(current)
+      index = first // SLICE_SIZE
+      current = await getSlice(clientSocket, request, hostname, resource, cacheKey, index)
+      if current is None or current[0].status != 206 or sliceVersion(current[0]) != probed:
+        return None
+      entry, body, fetched = current
+    firstIndex = index
+    version = sliceVersion(entry)
+    updates = {'content-range': 'bytes ' + str(first) + '-' + str(last) + '/' + str(total),
+               'content-length': str(last - first + 1), 'accept-ranges': 'bytes'}
+    await sendToClient(clientSocket, entry.responseHead(time.time(), updates))
+    request.responseStatus = 206
+    request.responseBytes = last - first + 1
+    request.cacheStatus = 'HIT'
+
+    # Once the head is out a failure can only end the connection
+    while True:
+      if sliceVersion(entry) != version:
+        # The object changed under us; the slices of both versions go
+        for stale in range(firstIndex, index + 1):
+          removeCached(sliceKey(cacheKey, stale))
+        raise ConnectionError('object changed while being served in slices')
+      sliceFirst = index * SLICE_SIZE
+      offset = max(first, sliceFirst) - sliceFirst
+      count = min(last, sliceFirst + SLICE_SIZE - 1) - sliceFirst - offset + 1
+      if entry.bodySize < offset + count:
+        raise ConnectionError('slice is shorter than its range')
+      if isinstance(body, bytes):
+        with memoryview(body) as view:
+          await sendToClient(clientSocket, view[offset:offset + count])
+      else:
+        await sendFileToClient(clientSocket, body, offset, count)
+      if fetched:
+        request.cacheStatus = 'MISS'
+      else:
+        metrics.count('bytes_from_cache', count)
+      closeCached(current)
+      index += 1
+      if index * SLICE_SIZE > last:
+        break
+      try:
+        current = await getSlice(clientSocket, request, hostname, resource, cacheKey, index)
+      except (RequestTimeout, Overloaded) as err:
+        raise ConnectionError('could not fetch a slice in time') from err
+      if current is None or current[0].status != 206:
+        raise ConnectionError('origin stopped serving slices')
+      entry, body, fetched = current
+  finally:
+    closeCached(current)
+  metrics.count('cache_misses' if request.cacheStatus == 'MISS' else 'cache_hits')
+  return True
+
+async def sendRangeNotSatisfiable(clientSocket, request, size):
+  request.responseStatus = 416
+  await sendToClient(clientSocket, ('HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */' + str(size) +
+                                    '\r\nContent-Length: 0\r\n\r\n').encode('latin-1'))
+  return True
+
+async def serveStats(clientSocket, request):
+  body = metrics.render().encode('latin-1')
+  head = ('HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n'
+          'Cache-Control: no-store\r\nContent-Length: ' + str(len(body)) + '\r\n\r\n')
+  request.responseStatus = 200
+  await sendToClient(clientSocket, head.encode('latin-1') + body)
+  request.responseBytes = len(body)
+  return True
+
+# Forward a request the cache cannot answer to its origin server, with
+# its body streamed from the client, and relay the response. A storable
+# response with a cacheKey is saved in the cache and, when it is small
+# enough, in the memory cache as well. With staleCached
+# the request is conditional and a 304 serves that stored response again,
+# as does an origin that fails or answers 5xx while stale-if-error allows.
+# Progress is published to sharedFetch for requests waiting on the same
+# URL. Returns whether the response was delimited so the client
+# connection can be reused.
+async def fetchFromOrigin(clientSocket, request, hostname, resource, cacheKey, staleCached=None, sharedFetch=None):
+  loop = asyncio.get_running_loop()
+  method = request.method
+
+  originServerRequest = ''
+  originServerRequestHeader = ''
+  # Create origin server request line and headers to send
+  # and store in originServerRequestHeader and originServerRequest
+  # originServerRequest is the first line in the request and
+  # originServerRequestHeader is the second line in the request
+  # The origin is always spoken to in HTTP/1.1 so that the connection can
+  # be kept alive and handed back to the pool afterwards
+  # ~~~~ INSERT CODE ~~~~
+  originServerRequest = f"{method} {resource} HTTP/1.1"
+  originServerRequestHeader = f"Host: {hostname}\r\nConnection: keep-alive"
+  # ~~~~ END CODE INSERT ~~~~
+  # A request body travels with its own framing
+  if request.hasBody:
+    if request.chunks is not None:
+      originServerRequestHeader += '\r\nTransfer-Encoding: chunked'
+    else:
+      originServerRequestHeader += '\r\nContent-Length: ' + str(request.bodyRemaining)
+  # A response to store is fetched whole, and a stale one is revalidated
+  # with the validators stored with it rather than the client's
+  leftOut = (PARTIAL_HEADERS if cacheKey is not None else frozenset())
+  if staleCached is not None:
+    originServerRequestHeader += staleCached[0].validators()
+    leftOut |= VALIDATOR_HEADERS
+  # Compressed responses are asked for in the codings this client takes
+  if COMPRESSION:
+    accepted = acceptedCodings(request)
+    codings = [coding for coding in CONTENT_CODINGS if acceptsCoding(accepted, coding)]
+    if codings:
+      originServerRequestHeader += '\r\nAccept-Encoding: ' + ', '.join(codings)
+    leftOut |= {b'accept-encoding'}
 
-      print('Request sent to origin server\n')
+  # Construct the request to send to the origin server: the proxy's own
+  # lines, then the client's headers as the bytes it sent
+  requestHead = forwardedHead(request, originServerRequest + '\r\n' + originServerRequestHeader + '\r\n', leftOut)
 
-      # Get the response from the origin server
+  # Request the web resource from origin server
+  log.debug('Forwarding request to origin server', head=originServerRequest)
+
+  # The stored response that answers instead when the origin fails
+  staleOnError = (staleCached is not None and
+                  staleCached[0].mayServeStale(requestCacheDirectives(request), time.time(),
+                                               'stale-if-error', STALE_IF_ERROR))
+  async def serveStale(reason):
+    log.warning('Origin failed, serving stale entry', key=cacheKey, reason=reason)
+    metrics.count('stale_served')
+    request.cacheStatus = 'STALE'
+    result = await serveStored(clientSocket, request, cacheKey, *staleCached)
+    if result is None:
+      result = await serveCached(clientSocket, request, *staleCached)
+    return result
+
+  # Responses are received into one pooled buffer, reused for every recv
+  await admitToOrigin(cacheKeyFor(hostname, ''))
+  relayBuffer = bufferPool.acquire(RELAY_BUFFER_SIZE)
+  try:
+    requestTime = time.time()
+    try:
+      exchange = await exchangeWithOrigin(clientSocket, request, hostname, requestHead, relayBuffer)
+    except RequestTimeout as err:
+      if not staleOnError:
+        raise
+      return await serveStale(str(err))
+    if exchange is None:
+      if staleOnError:
+        return await serveStale('unreachable')
+      request.responseStatus = 502
+      await sendToClient(clientSocket, BAD_GATEWAY_RESPONSE)
+      return False
+    originServerSocket, received = exchange
+
+    framer = ResponseFramer(method)
+    cacheWrite = None
+    variantWrite = None
+    try:
+      # Wait for the whole response head before deciding what to do with it
+      try:
+        used = framer.feed(relayBuffer, received)
+        while framer.headers is None:
+          with Timeout('origin', ORIGIN_READ_TIMEOUT):
+            received = await loop.sock_recv_into(originServerSocket, relayBuffer)
+          if not received:
+            framer.finish()
+          used = framer.feed(relayBuffer, received)
+      except (RequestTimeout, OSError, ValueError) as err:
+        if staleOnError:
+          originServerSocket.close()
+          return await serveStale(str(err))
+        if not isinstance(err, ValueError):
+          raise
+        # A head that cannot be parsed: the connection is not pooled
+        log.warning('Malformed response from origin', hostname=hostname, reason=str(err))
+        originServerSocket.close()
+        request.responseStatus = 502
+        await sendToClient(clientSocket, BAD_GATEWAY_RESPONSE)
+        return False
+      if used < received:
+        # Bytes past the end of the response: the origin is confused
+        framer.reusable = False
+      responseTime = time.time()
+      if staleOnError and framer.status in STALE_ERROR_STATUSES:
+        # The error is not relayed, and what is stored stays in place
+        originServerSocket.close()
+        return await serveStale('status ' + str(framer.status))
+      request.responseStatus = framer.status
+
+      if staleCached is not None and framer.status == 304:
+        # The stored body is still right: refresh its head and serve it
+        log.debug('Cache entry revalidated', key=cacheKey)
+        metrics.count('revalidations')
+        request.cacheStatus = 'REVALIDATED'
+        entry, body = staleCached
+        entry.refresh(framer, requestTime, responseTime)
+        cacheIndex.publish(entry.record())
+        if sharedFetch is not None:
+          sharedFetch.refreshed(entry)
+        releaseOrigin(hostname, originServerSocket, framer)
+        result = await serveStored(clientSocket, request, cacheKey, entry, body)
+        if result is None:
+          result = await serveCached(clientSocket, request, entry, body)
+        return result
+
+      entry = None
+      prefetchHeaders = None
+      if cacheKey is not None:
+        requestDirectives = requestCacheDirectives(request)
+        if isStorable(request, requestDirectives, framer):
+          # Create a new file in the cache for the requested file. Until
+          # it is complete the previous version stays in place. A chunked
+          # body is stored de-chunked; its Content-Length is added once
+          # the whole of it is known.
+          storedHead = storedResponseHead(framer)
+          try:
+            cacheLocation = cacheIndex.newLocation(cacheKey)
+            cacheWrite = CacheWrite(cacheLocation, sharedFetch.advance if sharedFetch is not None else None)
+            entry = CacheEntry(cacheKey, cacheLocation, storedHead, requestTime, responseTime, varyValues(request, framer))
+          except OSError as err:
+            log.error('Failed to create cache file', key=cacheKey, error=err)
+          if sharedFetch is not None:
+            if cacheWrite is not None:
+              sharedFetch.stream(entry, cacheWrite, framer.chunks is not None)
+            else:
+              sharedFetch.decline()
+          # A stored page is scanned for resources to prefetch, asked
+          # for as this client would
+          if prefetcher is not None and cacheWrite is not None and request.header(b'authorization') is None:
+            if PREFETCH_PAGE_TYPE.match(framer.headers.get('content-type', '')):
+              prefetchHeaders = backgroundHeaders(request)
+        else:
+          # Errors, no-store and private responses are not kept, and
+          # neither is whatever was stored for the URL before. A 304 only
+          # answers the client's own conditional request and says
+          # nothing against what is stored.
+          log.debug('Response is not cacheable', key=cacheKey)
+          if framer.status != 304:
+            removeCached(cacheKey)
+          if sharedFetch is not None:
+            sharedFetch.decline()
+
+      # Relay the response to the client as it arrives and tee the body
+      # into the cache. Only the one pooled buffer of RELAY_BUFFER_SIZE
+      # bytes is used per connection; the next recv waits until the client
+      # has taken it. The framer finds the end of the response so that the
+      # origin connection does not have to be closed to mark it. Chunked
+      # bodies are relayed as they are, except to HTTP/1.0 clients, which
+      # get the chunk data alone and a closed connection at the end. A
+      # body the origin did not compress is compressed for a client that
+      # takes it and sent chunked, or to HTTP/1.0 ended by closing; when
+      # the response is cached the compressed variant is cached with it.
+      # A body that came whole with the head is compressed in one piece
+      # and sent with its length instead.
       # ~~~~ INSERT CODE ~~~~
-      origin_response = b""
+      transferStarted = time.monotonic()
+      http10 = request.version == 'HTTP/1.0'
+      compressible = isCompressibleResponse(request, framer)
+      coding = preferredCoding(acceptedCodings(request)) if compressible else None
+      encoder = Transcoder('identity', coding) if coding is not None else None
+      compressed = None
+      if encoder is not None and framer.done:
+        spans = framer.payload if framer.chunks is not None else [(framer.bodyStart, used)]
+        compressed = encoder.feed(b''.join(relayBuffer[spanStart:spanEnd] for spanStart, spanEnd in spans)) + encoder.finish()
+      dechunk = (http10 and framer.chunks is not None) or (encoder is not None and (http10 or compressed is not None))
+      delimited = not dechunk or compressed is not None
+      if encoder is not None and cacheWrite is not None:
+        try:
+          variantWrite = CacheWrite(cacheIndex.newLocation(variantKey(cacheKey, coding)))
+        except OSError as err:
+          log.error('Failed to create cache file', key=cacheKey, error=err)
+      if dechunk or compressible:
+        updates = {}
+        if dechunk:
+          updates = {'transfer-encoding': None, 'trailer': None}
+          if compressed is None:
+            updates['connection'] = 'close'
+        if compressed is not None:
+          updates.update(variantHeaders(framer.headers, coding, len(compressed)))
+        elif encoder is not None:
+          updates.update(variantHeaders(framer.headers, coding, None))
+          updates['trailer'] = None
+          if not http10:
+            updates['transfer-encoding'] = 'chunked'
+        elif compressible:
+          # Other clients get it compressed
+          updates['vary'] = variantHeaders(framer.headers, 'identity', None)['vary']
+        await sendToClient(clientSocket, replaceHeaders(framer.head.decode('latin-1'), updates).encode('latin-1'))
+      else:
+        await sendToClient(clientSocket, framer.head)
+
+      # Send compressed output on, framed as a chunk unless to HTTP/1.0
+      async def sendEncoded(data):
+        if data:
+          await sendToClient(clientSocket, data if http10 else b'%x\r\n%s\r\n' % (len(data), data))
+          request.responseBytes += len(data)
+          if variantWrite is not None:
+            await variantWrite.write(data)
+      # Body chunks are also kept for the memory cache until the response
+      # outgrows the largest object it admits
+      memoryChunks = [] if cacheWrite is not None else None
+      memoryBytes = 0
+      start = framer.bodyStart
       while True:
-          data = originServerSocket.recv(BUFFER_SIZE)
-          if not data:
-              break
-          origin_response += data
+        if used > start:
+          metrics.count('bytes_from_origin', used - start)
+          spans = framer.payload if framer.chunks is not None else [(start, used)]
+          with memoryview(relayBuffer) as view:
+            if encoder is None and not dechunk:
+              await sendToClient(clientSocket, view[start:used])
+              request.responseBytes += used - start
+            for spanStart, spanEnd in spans:
+              if compressed is not None:
+                pass
+              elif encoder is not None:
+                await sendEncoded(encoder.feed(view[spanStart:spanEnd]))
+              elif dechunk:
+                await sendToClient(clientSocket, view[spanStart:spanEnd])
+                request.responseBytes += spanEnd - spanStart
+              if cacheWrite is not None:
+                # The writer thread gets its own copy; the buffer is reused
+                chunk = bytes(view[spanStart:spanEnd])
+                await cacheWrite.write(chunk)
+                if memoryChunks is not None:
+                  memoryBytes += len(chunk)
+                  if memoryBytes <= memoryCache.maxObjectBytes:
+                    memoryChunks.append(chunk)
+                  else:
+                    memoryChunks = None
+        if framer.done:
+          break
+        # Past the head a stalled origin can only be cut off
+        with Timeout('relay', ORIGIN_READ_TIMEOUT):
+          received = await loop.sock_recv_into(originServerSocket, relayBuffer)
+        if not received:
+          framer.finish()
+          break
+        used = framer.feed(relayBuffer, received)
+        start = 0
+        if used < received:
+          framer.reusable = False
+      if compressed is not None:
+        await sendToClient(clientSocket, compressed)
+        request.responseBytes += len(compressed)
+        if variantWrite is not None:
+          await variantWrite.write(compressed)
+      elif encoder is not None:
+        await sendEncoded(encoder.finish())
+        if not http10:
+          await sendToClient(clientSocket, b'0\r\n\r\n')
       # ~~~~ END CODE INSERT ~~~~
+      metrics.observe('transfer', time.monotonic() - transferStarted)
+    except BaseException:
+      # Never leave a truncated response behind to be served as a hit
+      if cacheWrite is not None:
+        cacheWrite.abort()
+      if variantWrite is not None:
+        variantWrite.abort()
+      originServerSocket.close()
+      raise
 
-      # Send the response to the client
-      # ~~~~ INSERT CODE ~~~~
-      clientSocket.sendall(origin_response)
-      # ~~~~ END CODE INSERT ~~~~
+    if cacheWrite is not None:
+      entry.bodySize = cacheWrite.offset
+      if framer.chunks is not None:
+        entry.head = replaceHeaders(entry.head, {'content-length': str(entry.bodySize)})
+        entry.parse()
+      memoryBody = b''.join(memoryChunks) if memoryChunks is not None else None
+      # The compressed variant is only committed once the body it names
+      # as its source is
+      variant = None
+      if variantWrite is not None:
+        variant = CacheEntry(variantKey(cacheKey, coding), variantWrite.cacheLocation, entry.head,
+                             requestTime, responseTime, entry.varyValues)
+        variant.source = entry.location
+        variant.bodySize = variantWrite.offset
+      def committed(done):
+        if not done:
+          if variant is not None:
+            variantWrite.abort()
+          if sharedFetch is not None:
+            sharedFetch.fail()
+          return
+        log.debug('Cache file committed', key=cacheKey)
+        if variant is not None:
+          variantWrite.commit(variant.record(), None)
+        if sharedFetch is not None:
+          sharedFetch.complete()
+        if memoryBody is not None:
+          memoryCache.put(cacheKey, (entry, memoryBody), len(entry.head) + len(memoryBody))
+        else:
+          memoryCache.remove(cacheKey)
+        if prefetchHeaders is not None:
+          prefetcher.pageCached(hostname, resource, entry, memoryBody, prefetchHeaders)
+      if sharedFetch is not None:
+        sharedFetch.committing()
+      cacheWrite.commit(entry.record(), committed)
 
-      # Create a new file in the cache for the requested file.
-      cacheDir, file = os.path.split(cacheLocation)
-      print ('cached directory ' + cacheDir)
-      if not os.path.exists(cacheDir):
-        os.makedirs(cacheDir)
-      cacheFile = open(cacheLocation, 'wb')
+    releaseOrigin(hostname, originServerSocket, framer)
+    return framer.reusable and delimited
+  finally:
+    bufferPool.release(relayBuffer)
+    leaveOrigin(cacheKeyFor(hostname, ''))
 
-      # Save origin server response in the cache file
-      # ~~~~ INSERT CODE ~~~~
-      cacheFile.write(origin_response)
-      # ~~~~ END CODE INSERT ~~~~
-      cacheFile.close()
-      print ('cache file closed')
+# Fetch a resource into the cache with no client waiting for it: one a
+# cached page links to, or with staleEntry one whose stored response
+# expired, which is revalidated and on a 304 just refreshed. It is
+# registered as a shared fetch, so a client asking for it meanwhile is
+# answered from the cache file as that grows.
+async def fetchInBackground(hostname, resource, cacheKey, request, staleEntry=None):
+  loop = asyncio.get_running_loop()
+  leftOut = {b'accept-encoding'} if COMPRESSION else frozenset()
+  ownLines = f"GET {resource} HTTP/1.1\r\nHost: {hostname}\r\nConnection: keep-alive"
+  if staleEntry is not None:
+    ownLines += staleEntry.validators()
+  requestHead = forwardedHead(request, ownLines + '\r\n', leftOut)
+  log.debug('Fetching from origin server in the background', key=cacheKey, revalidating=staleEntry is not None)
+  sharedFetch = SharedFetch(cacheKey)
+  sharedFetches[cacheKey] = sharedFetch
+  try:
+    await admitToOrigin(cacheKeyFor(hostname, ''))
+    buffer = bufferPool.acquire(RELAY_BUFFER_SIZE)
+    try:
+      requestTime = time.time()
+      exchange = await exchangeWithOrigin(None, request, hostname, requestHead, buffer)
+      if exchange is None:
+        return
+      originServerSocket, received = exchange
+
+      framer = ResponseFramer('GET')
+      cacheWrite = None
+      try:
+        used = framer.feed(buffer, received)
+        while framer.headers is None:
+          with Timeout('origin', ORIGIN_READ_TIMEOUT):
+            received = await loop.sock_recv_into(originServerSocket, buffer)
+          if not received:
+            framer.finish()
+          used = framer.feed(buffer, received)
+        responseTime = time.time()
+        if staleEntry is not None and framer.status == 304:
+          log.debug('Cache entry revalidated in the background', key=cacheKey)
+          metrics.count('revalidations')
+          staleEntry.refresh(framer, requestTime, responseTime)
+          cacheIndex.publish(staleEntry.record())
+          sharedFetch.refreshed(staleEntry)
+          releaseOrigin(hostname, originServerSocket, framer)
+          return
+        if not isStorable(request, {}, framer):
+          log.debug('Background response is not cacheable', key=cacheKey)
+          sharedFetch.decline()
+          originServerSocket.close()
+          return
+        storedHead = storedResponseHead(framer)
+        cacheLocation = cacheIndex.newLocation(cacheKey)
+        cacheWrite = CacheWrite(cacheLocation, sharedFetch.advance)
+        entry = CacheEntry(cacheKey, cacheLocation, storedHead, requestTime, responseTime, varyValues(request, framer))
+        sharedFetch.stream(entry, cacheWrite, framer.chunks is not None)
+
+        start = framer.bodyStart
+        while True:
+          if used < received:
+            framer.reusable = False
+          if used > start:
+            metrics.count('bytes_from_origin', used - start)
+            for spanStart, spanEnd in framer.payload if framer.chunks is not None else [(start, used)]:
+              await cacheWrite.write(bytes(buffer[spanStart:spanEnd]))
+          if framer.done:
+            break
+          with Timeout('relay', ORIGIN_READ_TIMEOUT):
+            received = await loop.sock_recv_into(originServerSocket, buffer)
+          if not received:
+            framer.finish()
+            break
+          used = framer.feed(buffer, received)
+          start = 0
+      except BaseException:
+        if cacheWrite is not None:
+          cacheWrite.abort()
+        originServerSocket.close()
+        raise
+      releaseOrigin(hostname, originServerSocket, framer)
+    finally:
+      bufferPool.release(buffer)
+      leaveOrigin(cacheKeyFor(hostname, ''))
+
+    entry.bodySize = cacheWrite.offset
+    if framer.chunks is not None:
+      entry.head = replaceHeaders(entry.head, {'content-length': str(entry.bodySize)})
+      entry.parse()
+    def committed(done):
+      if done:
+        log.debug('Fetched into the cache in the background', key=cacheKey, bytes=entry.bodySize)
+        sharedFetch.complete()
+      else:
+        sharedFetch.fail()
+    sharedFetch.committing()
+    cacheWrite.commit(entry.record(), committed)
+  finally:
+    sharedFetch.finish()
+
+# Fetch slice index of a large object with a Range request for exactly
+# that slice, buffering it whole, and store it under key when it may be.
+# Returns (entry, body) for a 206, or for a 416 when the object ends
+# before the slice, and None for any other answer, which means the
+# origin does not serve the object in ranges.
+async def fetchSlice(clientSocket, request, hostname, resource, key, index):
+  loop = asyncio.get_running_loop()
+  first = index * SLICE_SIZE
+  # Slices are stored as the origin sends them, so never compressed
+  requestHead = forwardedHead(request, f"GET {resource} HTTP/1.1\r\nHost: {hostname}\r\nConnection: keep-alive\r\n"
+                                       f"Range: bytes={first}-{first + SLICE_SIZE - 1}\r\n",
+                              PARTIAL_HEADERS | VALIDATOR_HEADERS | {b'accept-encoding'})
+  log.debug('Fetching slice from origin server', key=key)
+
+  await admitToOrigin(cacheKeyFor(hostname, ''))
+  buffer = bufferPool.acquire(RELAY_BUFFER_SIZE)
+  try:
+    requestTime = time.time()
+    exchange = await exchangeWithOrigin(clientSocket, request, hostname, requestHead, buffer)
+    if exchange is None:
+      return None
+    originServerSocket, received = exchange
+
+    framer = ResponseFramer('GET')
+    body = bytearray()
+    try:
+      try:
+        used = framer.feed(buffer, received)
+        while framer.headers is None:
+          with Timeout('origin', ORIGIN_READ_TIMEOUT):
+            received = await loop.sock_recv_into(originServerSocket, buffer)
+          if not received:
+            framer.finish()
+          used = framer.feed(buffer, received)
+      except ValueError as err:
+        log.warning('Malformed response from origin', hostname=hostname, reason=str(err))
+        originServerSocket.close()
+        return None
+      responseTime = time.time()
+      contentRange = parseContentRange(framer.headers.get('content-range', ''))
+      if framer.status == 416 and contentRange is not None and contentRange[2] is not None:
+        # Its body is of no use; the connection goes rather than reading it
+        originServerSocket.close()
+        return CacheEntry(key, None, framer.head.decode('latin-1'), requestTime, responseTime, {}), b''
+      if framer.status != 206 or contentRange is None or contentRange[0] != first or contentRange[2] is None:
+        log.debug('Origin does not serve slices', key=key, status=framer.status)
+        originServerSocket.close()
+        return None
 
-      # finished communicating with origin server - shutdown socket writes
-      print ('origin response received. Closing sockets')
+      # Collect the slice, which is at most SLICE_SIZE bytes
+      start = framer.bodyStart
+      while True:
+        if used < received:
+          framer.reusable = False
+        for spanStart, spanEnd in framer.payload if framer.chunks is not None else [(start, used)]:
+          body += buffer[spanStart:spanEnd]
+        if len(body) > SLICE_SIZE:
+          raise ConnectionError('origin sent more than the slice')
+        if framer.done:
+          break
+        with Timeout('origin', ORIGIN_READ_TIMEOUT):
+          received = await loop.sock_recv_into(originServerSocket, buffer)
+        if not received:
+          framer.finish()
+          break
+        start = 0
+        used = framer.feed(buffer, received)
+      if len(body) != contentRange[1] - contentRange[0] + 1:
+        raise ConnectionError('slice does not match its Content-Range')
+    except BaseException:
       originServerSocket.close()
-       
-      clientSocket.shutdown(socket.SHUT_WR)
-      print ('client socket shutdown for writing')
+      raise
+    releaseOrigin(hostname, originServerSocket, framer)
+  finally:
+    bufferPool.release(buffer)
+    leaveOrigin(cacheKeyFor(hostname, ''))
+
+  body = bytes(body)
+  storedHead = storedResponseHead(framer, {'content-length': str(len(body))})
+  entry = CacheEntry(key, cacheIndex.newLocation(key), storedHead, requestTime, responseTime, varyValues(request, framer))
+  entry.bodySize = len(body)
+  if not isStorable(request, requestCacheDirectives(request), framer, partial=True):
+    log.debug('Slice is not cacheable', key=key)
+    removeCached(key)
+    return entry, body
+  try:
+    cacheWrite = CacheWrite(entry.location)
+  except OSError as err:
+    log.error('Failed to create cache file', key=key, error=err)
+    return entry, body
+  await cacheWrite.write(body)
+  cacheWrite.commit(entry.record(), None)
+  log.debug('Cached slice', key=key, bytes=len(body))
+  return entry, body
+
+# The head of a request to an origin as a list of buffers: the proxy's
+# own lines, then the header lines of request as the client sent them,
+# less hop-by-hop ones, those its Connection header names, those the
+# proxy writes itself and those in leftOut
+def forwardedHead(request, ownLines, leftOut):
+  dropped = HOP_BY_HOP_HEADERS | PROXY_WRITTEN_HEADERS | leftOut
+  connection = request.header(b'connection')
+  if connection is not None:
+    dropped = dropped | {name.strip().lower().encode('latin-1') for name in connection.split(',')}
+  buffers = [ownLines.encode('latin-1')]
+  for name, line in request.fieldLines():
+    if name not in dropped:
+      buffers.append(line)
+      buffers.append(b'\r\n')
+  buffers.append(b'\r\n')
+  return buffers
+
+# Send buffers to a non-blocking sock with as few sendmsg calls as
+# possible, gathering them in the kernel instead of joining them first
+async def sendBuffers(sock, buffers):
+  buffers = list(buffers)
+  pending = 0
+  while pending < len(buffers):
+    try:
+      sent = sock.sendmsg(buffers[pending:pending + IOV_MAX])
+    except (BlockingIOError, InterruptedError):
+      await socketReady(sock, True)
+      continue
+    while sent:
+      size = len(buffers[pending])
+      if sent < size:
+        # Partly sent: go on from where the kernel stopped
+        buffers[pending] = memoryview(buffers[pending])[sent:]
+        break
+      sent -= size
+      pending += 1
+    while pending < len(buffers) and not len(buffers[pending]):
+      pending += 1
+
+# Send requestHead, a list of buffers, and the request body if there is
+# one, to the origin at hostname and wait for the first bytes of its
+# answer in buffer.
+# A pooled connection may have been closed by the origin while it sat
+# idle, which only shows once it is used. Such a request is retried on
+# a fresh connection. When a fresh connection fails an idempotent request
+# is retried on another address of the origin, up to ORIGIN_RETRIES
+# times; other failures are final. A body can only be streamed once, so
+# requests with one never take either chance. Returns
+# (originServerSocket, received) or None when the origin could not be
+# reached.
+async def exchangeWithOrigin(clientSocket, request, hostname, requestHead, buffer):
+  loop = asyncio.get_running_loop()
+  host, port = splitHostPort(hostname, 80)
+  retries = ORIGIN_RETRIES if not request.hasBody and request.method in IDEMPOTENT_METHODS else 0
+  failedAddresses = set()
+  originServerSocket = None if request.hasBody else originPool.acquire(hostname)
+  while True:
+    reused = originServerSocket is not None
+    if not reused:
+      try:
+        with Timeout('connect', ORIGIN_CONNECT_TIMEOUT):
+          originServerSocket = await connectToOrigin(host, port, failedAddresses)
+      except OSError as err:
+        log.warning('Origin connection failed', host=hostname, error=err.strerror or err)
+        metrics.count('origin_errors')
+        return None
+      log.debug('Connected to origin server', host=hostname)
+    else:
+      log.debug('Reusing pooled connection', host=hostname)
+    address = peerAddress(originServerSocket)
+    originBalancer.started(address)
+
+    # Until the response head is in, the origin has ORIGIN_READ_TIMEOUT
+    # seconds for each step and the client is answered with a 504 if
+    # it takes longer
+    try:
+      with Timeout('origin', ORIGIN_READ_TIMEOUT):
+        await sendBuffers(originServerSocket, requestHead)
+      if request.hasBody:
+        # The client waits for this before sending a large body
+        if request.header(b'expect', '').lower() == '100-continue':
+          await sendToClient(clientSocket, b'HTTP/1.1 100 Continue\r\n\r\n')
+        async for data in request.readBody():
+          with Timeout('origin', ORIGIN_READ_TIMEOUT):
+            await loop.sock_sendall(originServerSocket, data)
+      sentAt = time.monotonic()
+      with Timeout('origin', ORIGIN_READ_TIMEOUT):
+        received = await loop.sock_recv_into(originServerSocket, buffer)
     except OSError as err:
-      print ('origin server request failed. ' + err.strerror)
+      if not reused:
+        log.warning('Forward request to origin failed', host=hostname, error=err.strerror or err)
+      received = 0
+    except BaseException as err:
+      if isinstance(err, RequestTimeout):
+        originBalancer.failed(address)
+      else:
+        originBalancer.abandoned(address)
+      originServerSocket.close()
+      raise
+    if received:
+      latency = time.monotonic() - sentAt
+      metrics.observe('ttfb', latency)
+      originBalancer.succeeded(address, latency)
+      return originServerSocket, received
+    originServerSocket.close()
+    # A pooled connection the origin closed while idle says nothing
+    # about its health
+    if reused:
+      originBalancer.abandoned(address)
+    else:
+      originBalancer.failed(address)
+      metrics.count('origin_errors')
+      if not retries or address is None:
+        return None
+      retries -= 1
+      failedAddresses.add(address)
+      metrics.count('origin_retries')
+      log.warning('Retrying request on another origin address', host=hostname, failed=address[0])
+    originServerSocket = None
+
+# finished communicating with origin server - keep the connection for the
+# next request unless the origin asked for it to be closed
+def releaseOrigin(hostname, originServerSocket, framer):
+  if framer.reusable and framer.done:
+    originPool.release(hostname, originServerSocket)
+  else:
+    originServerSocket.close()
+
+# Periodically close origin connections that have sat idle for too long
+async def sweepOriginPool():
+  while True:
+    await asyncio.sleep(max(originPool.idleTimeout / 2, 1))
+    originPool.closeExpired()
 
+# Keep the disk cache within its budgets and checkpoint its index. Only
+# the first worker sweeps, so the same responses are not evicted twice,
+# and its checkpoints carry the use counts it has seen. A draining worker
+# leaves the cache to the process that replaces it, and that one holds
+# its first checkpoint back until the process it replaced is gone.
+async def sweepCache():
+  lastCheckpoint = time.monotonic()
+  while True:
+    await asyncio.sleep(CACHE_SWEEP_INTERVAL)
+    if draining:
+      return
+    try:
+      await cacheIndex.evict()
+      if cacheIndex.inherited:
+        if not predecessorRunning():
+          log.info('Replaced process has exited')
+          lastCheckpoint = time.monotonic()
+          cacheIndex.releaseInherited()
+      elif time.monotonic() - lastCheckpoint >= CACHE_CHECKPOINT_INTERVAL:
+        lastCheckpoint = time.monotonic()
+        cacheIndex.catchUp()
+        cacheIndex.checkpoint()
+    except Exception as err:
+      log.error('Cache sweep failed', error=err)
+
+# Fill the memory tier with the most used small responses in the index,
+# so that a restarted worker does not begin cold. The ranking and the
+# reads happen off the event loop, one body at a time.
+async def warmMemoryCache():
+  candidates = [entry for entry in cacheIndex.entries.values()
+                if entry.hits > 0 and entry.bodySize <= memoryCache.maxObjectBytes]
+  candidates = await asyncio.to_thread(sorted, candidates, key=lambda entry: entry.hits, reverse=True)
+  warmed = 0
+  for entry in candidates:
+    size = len(entry.head) + entry.bodySize
+    if memoryCache.usedBytes + size > memoryCache.maxBytes:
+      break
+    if await readIntoMemory(entry):
+      warmed += 1
+  log.info('Memory cache warmed', objects=warmed)
+
+# Read the body of entry into the memory tier off the event loop. Returns
+# False when it cannot be read, was replaced while being read or is in
+# memory already.
+async def readIntoMemory(entry):
   try:
-    clientSocket.close()
-  except:
-    print ('Failed to close client socket')
+    body = await asyncio.to_thread(readFile, entry.location)
+  except OSError:
+    return False
+  if cacheIndex.get(entry.key) is not entry or entry.key in memoryCache.entries or len(body) != entry.bodySize:
+    return False
+  memoryCache.put(entry.key, (entry, body), len(entry.head) + entry.bodySize)
+  return True
+
+def readFile(location):
+  with open(location, 'rb') as file:
+    return file.read()
+
+# Set once the worker has stopped accepting and is finishing the
+# connections it has. idleTimeouts are the waits for a next request on
+# kept-alive ones, which draining cuts short.
+draining = False
+idleTimeouts = set()
+
+# Run the worker's background jobs and accept connections until SIGQUIT,
+# then drain. Without a master process SIGHUP is handled here as well.
+async def runWorkerLoop():
+  loop = asyncio.get_running_loop()
+  cacheWriter.start(loop)
+  poolSweeper = loop.create_task(sweepOriginPool())
+  if workerIndex == 0:
+    cacheSweeper = loop.create_task(sweepCache())
+  warmer = loop.create_task(warmMemoryCache())
+  stopping = asyncio.Event()
+  loop.add_signal_handler(signal.SIGQUIT, stopping.set)
+  def hangup():
+    loop.remove_signal_handler(signal.SIGHUP)
+    spawnBackground(restartWorker(stopping, hangup))
+  if workerCount == 1:
+    loop.add_signal_handler(signal.SIGHUP, hangup)
+  # Keep a reference to every running client task until it finishes
+  clientTasks = set()
+  acceptor = loop.create_task(acceptConnections(clientTasks, stopping))
+  await stopping.wait()
+  acceptor.cancel()
+  await drainWorker(clientTasks)
+
+# continuously accept connections
+async def acceptConnections(clientTasks, stopping):
+  loop = asyncio.get_running_loop()
+  while True:
+    clientSocket = None
+
+    # Accept connection from client and store in the clientSocket
+    try:
+      # ~~~~ INSERT CODE ~~~~
+      clientSocket, clientAddress = await loop.sock_accept(serverSocket)
+      # ~~~~ END CODE INSERT ~~~~
+      acceptedAt = time.monotonic()
+      metrics.count('connections')
+    except OSError as err:
+      if err.errno in ACCEPT_FATAL_ERRORS:
+        # Accepting again would fail the same way; the worker drains instead
+        log.error('Listening socket is unusable', error=err)
+        stopping.set()
+        return
+      log.warning('Failed to accept connection', error=err)
+      if err.errno in ACCEPT_RESOURCE_ERRORS:
+        await asyncio.sleep(ACCEPT_RETRY_DELAY)
+      continue
+
+    startClient(clientTasks, clientSocket, clientAddress, acceptedAt)
+
+def startClient(clientTasks, clientSocket, clientAddress, acceptedAt):
+  task = asyncio.get_running_loop().create_task(serveClient(clientSocket, clientAddress, acceptedAt))
+  clientTasks.add(task)
+  task.add_done_callback(clientTasks.discard)
+
+# Stop taking connections and give the ones there are DRAIN_TIMEOUT to
+# finish, closing those idle between requests straight away. What the
+# cache writer has queued is written out before the worker exits.
+async def drainWorker(clientTasks):
+  global draining
+  draining = True
+  # Connections queued on a socket of the worker's own would be reset
+  # when it closes, so they are served first
+  while True:
+    try:
+      clientSocket, clientAddress = serverSocket.accept()
+    except OSError:
+      break
+    clientSocket.setblocking(False)
+    metrics.count('connections')
+    startClient(clientTasks, clientSocket, clientAddress, time.monotonic())
+  serverSocket.close()
+  log.info('Draining connections', connections=len(clientTasks))
+  for idle in list(idleTimeouts):
+    timerWheel.cancel(idle)
+    idle.expire()
+  if clientTasks:
+    done, pending = await asyncio.wait(clientTasks, timeout=DRAIN_TIMEOUT)
+    if pending:
+      log.warning('Closing connections left after draining', connections=len(pending))
+  await cacheWriter.flush()
+
+# A worker that is the whole proxy restarts itself: once the process that
+# replaces it is accepting, it drains
+async def restartWorker(stopping, hangup):
+  try:
+    await asyncio.to_thread(startSuccessor)
+  except OSError as err:
+    log.error('Restart failed', error=err)
+    asyncio.get_running_loop().add_signal_handler(signal.SIGHUP, hangup)
+    return
+  stopping.set()
+
+# Run one client handler and always release its socket afterwards
+async def serveClient(clientSocket, clientAddress, acceptedAt):
+  metrics.count('open_connections')
+  try:
+    tuneConnection(clientSocket)
+    await handleClient(clientSocket, clientAddress, acceptedAt)
+  except Exception as err:
+    log.warning('Client connection failed', client=clientAddress[0], error=err)
+    metrics.count('client_errors')
+  finally:
+    metrics.count('open_connections', -1)
+    try:
+      clientSocket.close()
+    except:
+      log.warning('Failed to close client socket')
+
+# Each worker runs its own event loop on the shared listening socket
+def runWorker():
+  log.start()
+  try:
+    asyncio.run(runWorkerLoop())
+  except KeyboardInterrupt:
+    pass
+  log.stop()
+
+# Start a new proxy from the script and config file as they are now and
+# hand it the listening socket. Returns once it has loaded the cache and
+# can accept; raises OSError when it exits before that, and this process
+# carries on as it was. The new process follows this one's cache journals
+# until the lifeline pipe closes, which happens when this process exits.
+def startSuccessor():
+  readyRead, readyWrite = os.pipe()
+  lifelineRead, lifelineWrite = os.pipe()
+  environment = dict(os.environ)
+  environment[INHERITED_SOCKET_ENV] = str(serverSocket.fileno())
+  environment[READY_PIPE_ENV] = str(readyWrite)
+  environment[LIFELINE_PIPE_ENV] = str(lifelineRead)
+  log.info('Starting replacement process')
+  try:
+    successor = subprocess.Popen([sys.executable] + sys.argv, env=environment,
+                                 pass_fds=(serverSocket.fileno(), readyWrite, lifelineRead))
+  except OSError:
+    os.close(readyRead)
+    os.close(lifelineWrite)
+    raise
+  finally:
+    os.close(readyWrite)
+    os.close(lifelineRead)
+  with open(readyRead, 'rb') as ready:
+    started = ready.read()
+  if not started:
+    os.close(lifelineWrite)
+    raise OSError('replacement process exited with status ' + str(successor.wait()))
+  log.info('Replacement process is accepting', pid=successor.pid)
+
+# Whether the process this one replaced is still running: it holds the
+# other end of the lifeline pipe, which reads as closed once it exits
+def predecessorRunning():
+  try:
+    return os.read(lifelinePipe, 1) != b''
+  except BlockingIOError:
+    return True
+
+# Raised in the master process by the signals it acts on between waits
+class MasterSignal(Exception):
+  def __init__(self, signum):
+    super().__init__(signal.Signals(signum).name)
+    self.signum = signum
+
+def raiseMasterSignal(signum, frame):
+  raise MasterSignal(signum)
+
+def handleMasterSignals(handler):
+  signal.signal(signal.SIGHUP, handler)
+  signal.signal(signal.SIGQUIT, handler)
+
+lifelinePipe = os.environ.pop(LIFELINE_PIPE_ENV, None)
+if lifelinePipe is not None:
+  lifelinePipe = int(lifelinePipe)
+  os.set_blocking(lifelinePipe, False)
+try:
+  cacheIndex.load(lifelinePipe is not None)
+except OSError as err:
+  log.error('Failed to open the cache', error=err)
+  sys.exit()
+
+# With SO_REUSEPORT every worker gets a listening socket of its own. They
+# are all opened before reporting ready, so none is missing while the
+# process this one replaces stops accepting.
+workerSockets = [openServerSocket() for i in range(workerCount)] if args.reuse_port and workerCount > 1 else None
+
+# Tell the process this one replaces that it can stop accepting
+readyPipe = os.environ.pop(READY_PIPE_ENV, None)
+if readyPipe is not None:
+  os.write(int(readyPipe), b'ready')
+  os.close(int(readyPipe))
+
+workerIndex = 0
+if workerCount == 1:
+  runWorker()
+else:
+  # Fork the workers; the kernel hands each new connection to one of them
+  workerPids = []
+  for i in range(workerCount):
+    pid = os.fork()
+    if pid == 0:
+      workerIndex = i
+      metrics.select(i)
+      if workerSockets is not None:
+        serverSocket.close()
+        serverSocket = workerSockets[i]
+        for other in workerSockets:
+          if other is not serverSocket:
+            other.close()
+      signal.signal(signal.SIGTERM, signal.default_int_handler)
+      signal.signal(signal.SIGHUP, signal.SIG_IGN)
+      runWorker()
+      os._exit(0)
+    workerPids.append(pid)
+  if workerSockets is not None:
+    for workerSocket in workerSockets:
+      workerSocket.close()
+  log.info('Started workers', workers=workerCount)
+
+  # SIGHUP starts a replacement with the config file as it is now and,
+  # once that is accepting, has the workers drain; SIGQUIT drains them
+  # without one. The master exits when its workers have.
+  handleMasterSignals(raiseMasterSignal)
+  try:
+    while workerPids:
+      try:
+        os.waitpid(workerPids[0], 0)
+        workerPids.pop(0)
+      except MasterSignal as received:
+        handleMasterSignals(signal.SIG_IGN)
+        if received.signum == signal.SIGHUP:
+          try:
+            startSuccessor()
+          except OSError as err:
+            log.error('Restart failed', error=err)
+            handleMasterSignals(raiseMasterSignal)
+            continue
+        log.info('Draining workers', workers=len(workerPids))
+        for pid in workerPids:
+          try:
+            os.kill(pid, signal.SIGQUIT)
+          except ProcessLookupError:
+            pass
+  except KeyboardInterrupt:
+    for pid in workerPids:
+      try:
+        os.kill(pid, signal.SIGTERM)
+      except ProcessLookupError:
+        pass